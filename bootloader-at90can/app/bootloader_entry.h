@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2010, 2015-2017 Fabian Greif.
+ * All rights reserved.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+/**
+ * \file
+ * \brief   Start the CAN bootloader from the application
+ *
+ * The application calls bootloader_enter() when it receives a
+ * START_BOOTLOADER message from the host (standard identifier 0x7ff,
+ * data[0] = board id, data[1] = 127).
+ *
+ * A magic value is stored at the end of the SRAM and a watchdog reset is
+ * triggered. The bootloader recognizes the request, announces itself with
+ * an IDENTIFY response and waits for the host without a timeout.
+ *
+ * Bootloaders with BOOT_STAGING let the application write a new image into
+ * the staging area while it keeps running:
+ *
+ *  1. write the image with bootloader_write_staging_page(), starting with
+ *     index 0
+ *  2. put the descriptor into the last eight bytes of the last page
+ *     (index bootloader_staging_pages() - 1), little endian:
+ *     0x5AA5, the length of the image in bytes (32 bit) and its CRC-16
+ *     (_crc_ccitt_update() starting with 0xffff)
+ *  3. call bootloader_commit_staged()
+ *
+ * After the reset the bootloader checks the CRC of the staged image and
+ * copies it over the application before it is started. An interrupted
+ * copy is finished after the next reset.
+ */
+
+#ifndef BOOTLOADER_ENTRY_H
+#define BOOTLOADER_ENTRY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <avr/io.h>
+#include <avr/wdt.h>
+#include <avr/interrupt.h>
+
+#define BOOTLOADER_ENTRY_MAGIC      0xB007
+#define BOOTLOADER_COMMIT_MAGIC     0xC0DE
+
+// Top of the stack. Only the return address of main() is stored here,
+// the bootloader checks the value before it uses the stack.
+#define BOOTLOADER_ENTRY_ADDRESS    ((volatile uint16_t *) (RAMEND - 1))
+
+// Jump table of the bootloader, see BOOT_API_START in the Makefile
+#define BOOTLOADER_API_ADDRESS      0x1FFF8UL
+
+/**
+ * Reset into the bootloader, never returns.
+ */
+static inline void
+bootloader_enter(void) __attribute__((noreturn));
+
+static inline void
+bootloader_enter(void)
+{
+    cli();
+    *BOOTLOADER_ENTRY_ADDRESS = BOOTLOADER_ENTRY_MAGIC;
+
+    wdt_enable(WDTO_15MS);
+    while (1) {
+    }
+}
+
+/**
+ * Number of pages of the staging area (requires BOOT_STAGING).
+ */
+static inline uint16_t
+bootloader_staging_pages(void)
+{
+    return ((uint16_t (*)(void)) (BOOTLOADER_API_ADDRESS / 2))();
+}
+
+/**
+ * Write a page of the staging area (requires BOOT_STAGING).
+ *
+ * Interrupts are disabled for the erase and write of the page (about
+ * 10 ms).
+ *
+ * \param   index   page within the staging area
+ * \param   *data   content of the page (SPM_PAGESIZE bytes)
+ * \return  false if the page lies outside of the staging area
+ */
+static inline bool
+bootloader_write_staging_page(uint16_t index, const uint8_t *data)
+{
+    return ((bool (*)(uint16_t, const uint8_t *)) (BOOTLOADER_API_ADDRESS / 2 + 2))(index, data);
+}
+
+/**
+ * Reset and replace the application with the staged image, never returns.
+ *
+ * The current application is started again if the staging area holds no
+ * valid image.
+ */
+static inline void
+bootloader_commit_staged(void) __attribute__((noreturn));
+
+static inline void
+bootloader_commit_staged(void)
+{
+    cli();
+    *BOOTLOADER_ENTRY_ADDRESS = BOOTLOADER_COMMIT_MAGIC;
+
+    wdt_enable(WDTO_15MS);
+    while (1) {
+    }
+}
+
+#endif // BOOTLOADER_ENTRY_H
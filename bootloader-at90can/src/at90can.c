@@ -13,24 +13,40 @@
 #include <avr/interrupt.h>
 
 #include "../src/defaults.h"
+#include "../src/stats.h"
 
+volatile uint8_t at90can_tx_free;
+
+#if !BOOT_POLLED
 volatile uint8_t at90can_messages_waiting;
-volatile uint8_t at90can_free_buffer;           //!< Stores the number of currently free MObs
+
+volatile uint8_t at90can_rx_queue[8];
+static uint8_t at90can_rx_head;                 //!< Next free entry of the queue
+uint8_t at90can_rx_tail;
+#endif
 
 uint8_t message_board_id;
+#if BOOT_MULTICAST
+uint8_t message_group_id;
+#endif
 
 uint8_t message_number;
 uint8_t message_data_counter;
 uint8_t message_data_length;
-uint8_t message_data[4];
+uint8_t message_data[8];
+#if BOOT_MULTICAST
+bool message_multicast;
+#endif
+#if BOOT_BOARD_IDENTIFIERS
+uint16_t message_identifier_receive;
+uint16_t message_identifier_send;
+bool message_board_identifier;
+#endif
 
 
 void
-at90can_init(uint8_t bitrate)
+at90can_set_bitrate(uint8_t bitrate)
 {
-    // switch CAN controller to reset mode
-    CANGCON |= (1 << SWRES);
-
     // set CAN Bit Timing
     // (see datasheet page 260)
     switch (bitrate)
@@ -86,10 +102,75 @@ at90can_init(uint8_t bitrate)
         CANBT3 = 0x36;
         break;
     }
+}
+
+#if BOOT_AUTOBAUD
+void
+at90can_listen(uint8_t bitrate)
+{
+    // switch CAN controller to reset mode
+    CANGCON = (1 << SWRES);
+
+    at90can_set_bitrate(bitrate);
+
+    // disable all MObs
+    for (uint8_t mob = 0; mob < 15; mob++)
+    {
+        CANPAGE = (mob << 4);
+
+        // disable MOb (read-write required)
+        CANCDMOB &= 0;
+        CANSTMOB &= 0;
+    }
+
+    // MOb 0 accepts every frame
+    CANPAGE = 0;
+    CANIDM4 = 0;
+    CANIDM3 = 0;
+    CANIDM2 = 0;
+    CANIDM1 = 0;
+    CANCDMOB = (1 << CONMOB1);
+
+    // clear the error flags (write one to clear)
+    CANGIT = (1 << SERG) | (1 << CERG) | (1 << FERG) | (1 << AERG);
+
+    // listen-only, the controller sends neither acknowledges nor
+    // error frames
+    CANGCON = (1 << LISTEN) | (1 << ENASTB);
+}
+
+int8_t
+at90can_listen_status(void)
+{
+    CANPAGE = 0;
+    if (CANSTMOB & (1 << RXOK)) {
+        return 1;
+    }
+
+    if (CANGIT & ((1 << SERG) | (1 << CERG) | (1 << FERG) | (1 << AERG))) {
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+void
+at90can_init(uint8_t bitrate)
+{
+    // switch CAN controller to reset mode
+    CANGCON |= (1 << SWRES);
+
+    at90can_set_bitrate(bitrate);
 
-    // activate CAN transmit- and receive-interrupt
     CANGIT = 0;
+#if BOOT_POLLED
+    // the status of the MObs is polled
+    CANGIE = 0;
+#else
+    // activate CAN transmit- and receive-interrupt
     CANGIE = (1 << ENIT) | (1 << ENRX) | (1 << ENTX);
+#endif
 
     // set timer prescaler to 199 which results in a timer
     // frequency of 10 kHz (at 16 MHz)
@@ -110,36 +191,77 @@ at90can_init(uint8_t bitrate)
     }
 
     // mark all MObs as free
+#if !BOOT_POLLED
     at90can_messages_waiting = 0;
-    at90can_free_buffer = 7;
+    at90can_rx_head = 0;
+    at90can_rx_tail = 0;
+#endif
+    at90can_tx_free = 0x7F;
 
+#if BOOT_EXTENDED_DATA
+    // set filter for the extended DATA frames of this board
+    for (uint8_t mob = 0; mob < CAN_EXTENDED_MOBS; mob++)
+    {
+        CANPAGE = (mob << 4);
+
+        CANSTMOB = 0;
+        CANCDMOB = (1 << CONMOB1) | (1 << IDE);
+
+        // only extended, non-rtr frames with the receive prefix and the
+        // board id in the bits 28..16 of the identifier
+        CANIDT4 = 0;
+        CANIDT3 = 0;
+        CANIDT2 = (uint8_t) (message_board_id << 3);
+        CANIDT1 = (uint8_t) ((CAN_EXTENDED_PREFIX_RECEIVE << 3) | (message_board_id >> 5));
+
+        CANIDM4 = (1 << IDEMSK) | (1 << RTRMSK);
+        CANIDM3 = 0;
+        CANIDM2 = 0xF8;
+        CANIDM1 = 0xFF;
+    }
+
+    // set filter for the remaining MObs up to 8
+    for (uint8_t mob = CAN_EXTENDED_MOBS; mob < 8; mob++)
+#else
     // set filter for MOb 0 to 8
     for (uint8_t mob = 0; mob < 8; mob++)
+#endif
     {
         CANPAGE = (mob << 4);
 
         CANSTMOB = 0;
         CANCDMOB = (1 << CONMOB1);
 
-        // only standard, non-rtr frames with identifier 0x7ff
+        uint16_t identifier = CAN_IDENTIFIER_RECEIVE;
+#if BOOT_BOARD_IDENTIFIERS
+        if (mob < 8 - CAN_COMMON_MOBS) {
+            identifier = message_identifier_receive;
+        }
+#endif
+
+        // only standard, non-rtr frames with identifier 0x7ff (or the
+        // identifier of the board)
         CANIDT4 = 0;
         CANIDT3 = 0;
-        CANIDT2 = (uint8_t) (CAN_IDENTIFIER_RECEIVE << 5);
-        CANIDT1 = (uint8_t) (CAN_IDENTIFIER_RECEIVE >> 3);
+        CANIDT2 = (uint8_t) (identifier << 5);
+        CANIDT1 = (uint8_t) (identifier >> 3);
 
         CANIDM4 = (1 << IDEMSK) | (1 << RTRMSK);
         CANIDM3 = 0;
-        CANIDM2 = (uint8_t) (CAN_IDENTIFIER_RECEIVE << 5);
-        CANIDM1 = (uint8_t) (CAN_IDENTIFIER_RECEIVE >> 3);
+        CANIDM2 = (uint8_t) (0x7FF << 5);
+        CANIDM1 = (uint8_t) (0x7FF >> 3);
     }
 
+#if !BOOT_POLLED
     // enable interrupts for the MObs
     CANIE2 = 0xFF;
+#endif
 
     // activate CAN controller
     CANGCON = (1 << ENASTB);
 }
 
+#if !BOOT_POLLED
 // The CANPAGE register have to be restored after usage, otherwise it
 // could cause trouble in the application programm.
 ISR(CANIT_vect)
@@ -163,12 +285,23 @@ ISR(CANIT_vect)
             CANSTMOB &= 0;
             CANCDMOB &= 0;
 
-            at90can_free_buffer++;
+            at90can_tx_free |= 1 << (mob - 8);
         }
         else
         {
-            // a message was received successfully
+            // a message was received successfully, remember the MOb in
+            // the order of the reception. Every receive MOb holds at most
+            // one message, the queue can't overflow.
+            at90can_rx_queue[at90can_rx_head] = mob;
+            at90can_rx_head = (at90can_rx_head + 1) % 8;
             at90can_messages_waiting++;
+
+#if BOOT_STATS
+            // further frames are lost until a message is processed
+            if (at90can_messages_waiting == 8) {
+                stats.rx_overruns++;
+            }
+#endif
         }
 
         // reset interrupt
@@ -181,6 +314,10 @@ ISR(CANIT_vect)
             CANIE1 &= ~(1 << (mob - 8));
         }
 
+        // continue with the next queued message. Not before the interrupt
+        // of the MOb is reset, the message could use the same MOb.
+        at90can_send_queued();
+
         // restore MOb page register
         CANPAGE = canpage;
     }
@@ -196,3 +333,4 @@ ISR(CANIT_vect)
 ISR(OVRIT_vect)
 {
 }
+#endif
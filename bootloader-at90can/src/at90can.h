@@ -18,14 +18,25 @@
 #include "defaults.h"
 
 extern volatile uint8_t at90can_messages_waiting;
-extern volatile uint8_t at90can_free_buffer;
+extern volatile uint8_t at90can_tx_free;       //!< Bitmap of the free send MObs (bit 0 = MOb 8)
+
+// Receive MObs in the order of the reception, filled by the interrupt
+// (not used with BOOT_POLLED)
+extern volatile uint8_t at90can_rx_queue[8];
+extern uint8_t at90can_rx_tail;                 //!< Next MOb to read
 
 extern uint8_t message_board_id;
+extern uint8_t message_group_id;        //!< Programming group, 0 if none
 
 extern uint8_t message_number;          //!< Running number of the messages
 extern uint8_t message_data_counter;
 extern uint8_t message_data_length;     //!< Length of the data-field
-extern uint8_t message_data[4];
+extern uint8_t message_data[8];        //!< Only extended frames use more than four bytes
+extern bool message_multicast;          //!< Message was sent to the group
+
+extern uint16_t message_identifier_receive; //!< Request identifier of this board
+extern uint16_t message_identifier_send;    //!< Response identifier of this board
+extern bool message_board_identifier;   //!< Message was received with the board identifier
 
 typedef enum
 {
@@ -49,6 +60,52 @@ typedef enum
     SET_BOARD_ID    = 10,
     SET_BITRATE     = 11,
 
+    // only available in type >= 1
+    FLASH_CRC       = 12,
+
+    // only available with BOOT_COMPRESSED_DATA
+    COMPRESSED_DATA = 13,
+
+    // only available with BOOT_MULTICAST
+    JOIN_GROUP      = 14,
+    GROUP_STATUS    = 15,
+
+    // only available in type >= 1
+    READ_FLASH_RANGE = 16,
+    SET_EEPROM_ADDRESS = 17,
+    EEPROM_DATA     = 18,
+    READ_EEPROM_RANGE = 19,
+
+    // only available in type >= 2
+    SET_BOOT_WINDOW = 20,
+
+    // only available with BOOT_DATA_OFFSET
+    DATA_OFFSET     = 21,
+
+    // only available in type >= 2 with BOOT_BOARD_IDENTIFIERS
+    SET_IDENTIFIERS = 22,
+
+    // only available in type >= 1
+    ERASE_RANGE     = 23,
+
+    // only available with BOOT_STATS
+    STATS           = 24,
+
+    // only available with BOOT_TRACE
+    TRACE_DUMP      = 25,
+
+    // only available in type >= 2 with BOOT_SESSION_BITRATE
+    SESSION_BITRATE = 26,
+
+    // only available with BOOT_ACK_INTERVAL
+    SET_ACK_INTERVAL = 27,
+
+    // only available with BOOT_PATCH_PAGE
+    PATCH_PAGE      = 28,
+
+    // only available in type >= 1 with BOOT_STAGING
+    COMMIT_STAGED   = 29,
+
 
     // Message Type
     REQUEST                 = 0x00,
@@ -73,11 +130,44 @@ typedef enum
 
 #define COMMAND_MASK            0x3F
 #define START_OF_MESSAGE_MASK   0x80
+#define DATA_OFFSET_RESPOND     0x80    //!< Answer this DATA_OFFSET message
+
+/**
+ * Set the bit timing registers, the controller has to be in reset mode.
+ *
+ * \param   bitrate see bitrate_t, unknown values select 125 kbps
+ */
+void
+at90can_set_bitrate(uint8_t bitrate);
+
+/**
+ * Start listening to the bus with the given bitrate.
+ *
+ * The controller is switched to listen-only mode and accepts every frame.
+ * at90can_init() has to be called afterwards to start the normal
+ * operation.
+ */
+void
+at90can_listen(uint8_t bitrate);
+
+/**
+ * Check the result of at90can_listen().
+ *
+ * \return  1 if a frame was received without errors, -1 if a bus error
+ *          was detected (wrong bitrate) and 0 if nothing happend so far
+ */
+int8_t
+at90can_listen_status(void);
 
 /**
  * The lower eight MObs are used for receiption, the upper seven for
  * transmission. This separation simplifies the access to the registers
  * and leads to smaller code size.
+ *
+ * With BOOT_BOARD_IDENTIFIERS the receive MObs accept only the request
+ * identifier of this board, except MOb 7 which stays on the common
+ * identifier 0x7ff. message_identifier_receive and message_identifier_send
+ * have to be set before.
  */
 void
 at90can_init(uint8_t bitrate);
@@ -85,9 +175,17 @@ at90can_init(uint8_t bitrate);
 /**
  * Send a message.
  *
- * If all seven send buffers are used this method waits until one gets free.
+ * The message is copied into a queue and sent as soon as one of the seven
+ * send MObs is free, so the function returns immediately. Only if the
+ * queue is full it waits until the interrupt has sent a message.
+ * Responses to group messages are dropped, otherwise every board of the
+ * group would answer.
+ * Messages with more than four data bytes are sent with an extended
+ * identifier, which contains the board id, the type and the data counter
+ * instead of the first four data bytes.
  *
- * \param   length  Length of the data segment (0-4)
+ * \param   length  Length of the data segment (0-4, 0-8 with
+ *                  BOOT_EXTENDED_DATA)
  */
 void
 at90can_send_message(command_t type, uint8_t length);
@@ -101,4 +199,34 @@ at90can_send_message(command_t type, uint8_t length);
 command_t
 at90can_get_message(void);
 
+/**
+ * Load queued messages into the free send MObs.
+ *
+ * Called by the interrupt when a message was sent, interrupts have to be
+ * disabled.
+ */
+void
+at90can_send_queued(void);
+
+/**
+ * Wait until all queued messages are sent.
+ *
+ * \param   timeout Time to wait in ticks of the CAN timer (100 us)
+ * \return  false if the messages were not sent in time, they are
+ *          discarded then
+ */
+bool
+at90can_wait_sent(uint16_t timeout);
+
+#if BOOT_POLLED
+/**
+ * Release the MObs of sent messages and continue with the queue.
+ *
+ * Replaces the transmit interrupt with BOOT_POLLED. Called while waiting
+ * for messages.
+ */
+void
+at90can_poll_sent(void);
+#endif
+
 #endif // AT90CAN_H
@@ -10,7 +10,10 @@
 #include <util/atomic.h>
 
 #include "at90can.h"
+#include "stats.h"
+#include "trace.h"
 
+#if !BOOT_POLLED
 static bool
 at90can_check_message(void)
 {
@@ -23,6 +26,27 @@ at90can_check_message(void)
         return false;
     }
 }
+#endif
+
+static void
+at90can_release_message(uint8_t mob)
+{
+#if !BOOT_POLLED
+    // mark message as processed
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        at90can_messages_waiting--;
+    }
+
+    // re-enable interrupts
+    CANIE2 |= (1 << mob);
+#else
+    (void) mob;
+#endif
+
+    // clear flags, but keep the identifier type of the MOb
+    CANCDMOB = (1 << CONMOB1) | (CANCDMOB & (1 << IDE));
+}
 
 static command_t
 at90can_read_message(uint8_t mob)
@@ -30,22 +54,72 @@ at90can_read_message(uint8_t mob)
     // clear flags (read-write-cycle required)
     CANSTMOB &= 0;
 
-    // read status
+    // read status, a DLC above 8 still means eight data bytes
     message_data_length = CANCDMOB & 0x0f;
+    if (message_data_length > 8) {
+        message_data_length = 8;
+    }
+
+#if BOOT_BOARD_IDENTIFIERS
+    // the response is sent with the identifier of the board if the request
+    // was received with it
+    message_board_identifier = (mob < 8 - CAN_COMMON_MOBS);
+#endif
+
+#if BOOT_EXTENDED_DATA
+    if (CANCDMOB & (1 << IDE))
+    {
+        // Extended frames are only accepted for DATA messages of this
+        // board (see at90can_init()). The identifier contains the board id
+        // (bits 23..16), the message number (15..8) and the data
+        // counter (7..0).
+        message_number       = (CANIDT2 << 5) | (CANIDT3 >> 3);
+        message_data_counter = (CANIDT3 << 5) | (CANIDT4 >> 3);
+        TRACE_AT(CANSTM, TRACE_RX, DATA);
+#if BOOT_MULTICAST
+        message_multicast    = false;
+#endif
+
+        for (uint8_t i = 0; i < message_data_length; i++)
+        {
+            message_data[i] = CANMSG;
+        }
+
+        at90can_release_message(mob);
+        return DATA;
+    }
+#endif
 
     uint8_t board_id = CANMSG;
     uint8_t type     = CANMSG;
+    uint8_t number   = CANMSG;
+
+    bool multicast = (board_id == MULTICAST_BOARD_ID) && (type == NO_OPERATION);
+#if BOOT_MULTICAST
+    // Messages to a programming group carry the group id instead of the
+    // message number
+    if ((board_id == MULTICAST_BOARD_ID)
+        && (message_group_id != 0) && (number == message_group_id))
+    {
+        multicast = true;
+    }
+#endif
 
     if ((message_data_length >= 4)
-        && ((board_id == message_board_id)
-            || ((board_id == MULTICAST_BOARD_ID) && (type == NO_OPERATION))))
+        && ((board_id == message_board_id) || multicast))
     {
         // Only process data if the board number matches. Otherwise
         // the received message is not reported.
-        message_number       = CANMSG;
+#if BOOT_MULTICAST
+        message_multicast    = multicast;
+#endif
+        message_number       = number;
         message_data_counter = CANMSG;
         message_data_length -= 4;
 
+        // time of the reception
+        TRACE_AT(CANSTM, TRACE_RX, type);
+
         // read data
         for (uint8_t i = 0; i < message_data_length; i++)
         {
@@ -54,41 +128,74 @@ at90can_read_message(uint8_t mob)
     }
     else
     {
+        STATS_INC(frames_rejected);
         type = NO_MESSAGE;
     }
 
-    // mark message as processed
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    at90can_release_message(mob);
+    return type;
+}
+
+#if BOOT_POLLED
+command_t
+at90can_get_message(void)
+{
+    at90can_poll_sent();
+
+    // Search the oldest received message. The MObs are filled in any
+    // order, the timestamps give the order of the reception.
+    uint16_t now = CANTIM;
+    uint16_t age = 0;
+    uint8_t oldest = 0xFF;
+#if BOOT_STATS
+    uint8_t waiting = 0;
+#endif
+    for (uint8_t mob = 0; mob < 8; mob++)
     {
-        at90can_messages_waiting--;
+        CANPAGE = mob << 4;
+        if (CANSTMOB & (1 << RXOK))
+        {
+            uint16_t t = now - CANSTM;
+            if (oldest == 0xFF || t >= age)
+            {
+                age = t;
+                oldest = mob;
+            }
+#if BOOT_STATS
+            waiting++;
+#endif
+        }
     }
 
-    // re-enable interrupts
-    CANIE2 |= (1 << mob);
+    if (oldest == 0xFF) {
+        return NO_MESSAGE;
+    }
 
-    // clear flags
-    CANCDMOB = (1 << CONMOB1);
+#if BOOT_STATS
+    // further frames are lost until a message is processed
+    if (waiting == 8) {
+        stats.rx_overruns++;
+    }
+#endif
 
-    return type;
+    CANPAGE = oldest << 4;
+    return at90can_read_message(oldest);
 }
-
+#else
 command_t
 at90can_get_message(void)
 {
     // check if there is any waiting message
     if (at90can_check_message())
     {
-        // find the MOb with the received message
-        for (uint8_t mob = 0; mob < 8; mob++)
-        {
-            CANPAGE = mob << 4;
+        // take the oldest message
+        uint8_t mob = at90can_rx_queue[at90can_rx_tail];
+        at90can_rx_tail = (at90can_rx_tail + 1) % 8;
 
-            if (CANSTMOB & (1 << RXOK))
-            {
-                return at90can_read_message(mob);
-            }
-        }
+        CANPAGE = mob << 4;
+        return at90can_read_message(mob);
     }
 
     return NO_MESSAGE;
 }
+#endif
@@ -7,67 +7,211 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/.
  */
 
+#include <string.h>
+
 #include <util/atomic.h>
 
 #include "at90can.h"
 #include "defaults.h"
+#include "trace.h"
+
+// Copy of the message header and data of a queued message
+typedef struct
+{
+    uint8_t type;
+    uint8_t length;
+    uint8_t number;
+    uint8_t counter;
+#if BOOT_BOARD_IDENTIFIERS
+    bool board_identifier;
+#endif
+    uint8_t data[8];
+} at90can_tx_message_t;
+
+static at90can_tx_message_t at90can_tx_queue[CAN_TX_QUEUE_SIZE];
+static uint8_t at90can_tx_head;                 //!< Next free entry
+static uint8_t at90can_tx_tail;                 //!< Next entry to send
+static volatile uint8_t at90can_tx_count;       //!< Number of queued messages
 
 static void
-at90can_write_message(command_t type, uint8_t length, uint8_t mob)
+at90can_write_message(const at90can_tx_message_t *msg, uint8_t mob)
 {
     // clear flags (read-write-cycle required)
     CANSTMOB &= 0;
 
-    // set identifier
-    CANIDT4 = 0;
-    CANIDT3 = 0;
-    CANIDT2 = (uint8_t) (CAN_IDENTIFIER_SEND << 5);
-    CANIDT1 = (uint8_t) (CAN_IDENTIFIER_SEND >> 3);
+    uint8_t cdmob;
 
-    CANMSG = message_board_id;
-    CANMSG = (uint8_t) type;
-    CANMSG = message_number;
-    CANMSG = message_data_counter;
+#if BOOT_EXTENDED_DATA
+    if (msg->length > 4)
+    {
+        // set identifier: prefix, board id (bits 23..16), type (15..8)
+        // and data counter (7..0)
+        CANIDT4 = (uint8_t) (msg->counter << 3);
+        CANIDT3 = (uint8_t) ((msg->type << 3) | (msg->counter >> 5));
+        CANIDT2 = (uint8_t) ((message_board_id << 3) | (msg->type >> 5));
+        CANIDT1 = (uint8_t) ((CAN_EXTENDED_PREFIX_SEND << 3) | (message_board_id >> 5));
+
+        cdmob = (1 << CONMOB0) | (1 << IDE) | msg->length;
+    }
+    else
+#endif
+    {
+        uint16_t identifier = CAN_IDENTIFIER_SEND;
+#if BOOT_BOARD_IDENTIFIERS
+        if (msg->board_identifier) {
+            identifier = message_identifier_send;
+        }
+#endif
+
+        // set identifier
+        CANIDT4 = 0;
+        CANIDT3 = 0;
+        CANIDT2 = (uint8_t) (identifier << 5);
+        CANIDT1 = (uint8_t) (identifier >> 3);
+
+        CANMSG = message_board_id;
+        CANMSG = msg->type;
+        CANMSG = msg->number;
+        CANMSG = msg->counter;
+
+        cdmob = (1 << CONMOB0) | (msg->length + 4);
+    }
 
     // copy data
-    const uint8_t *p = message_data;
-    for (uint8_t i = 0; i < length; i++)
+    const uint8_t *p = msg->data;
+    for (uint8_t i = 0; i < msg->length; i++)
     {
         CANMSG = *p++;
     }
 
+#if !BOOT_POLLED
     // enable MOb interrupt
     CANIE1 |= (1 << (mob - 8));
+#else
+    (void) mob;
+#endif
 
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    // enable transmission
+    CANCDMOB = cdmob;
+}
+
+void
+at90can_send_queued(void)
+{
+    while (at90can_tx_count != 0 && at90can_tx_free != 0)
     {
-        at90can_free_buffer--;
-    }
+        // first free MOb
+        uint8_t mob = 8;
+        uint8_t mask = 1;
+        while (!(at90can_tx_free & mask))
+        {
+            mob++;
+            mask <<= 1;
+        }
+        at90can_tx_free &= ~mask;
 
-    // enable transmission
-    CANCDMOB = (1 << CONMOB0) | (length + 4);
+        CANPAGE = mob << 4;
+        at90can_write_message(&at90can_tx_queue[at90can_tx_tail], mob);
+
+        at90can_tx_tail = (at90can_tx_tail + 1) % CAN_TX_QUEUE_SIZE;
+        at90can_tx_count--;
+    }
 }
 
+#if BOOT_POLLED
 void
-at90can_send_message(command_t type, uint8_t length)
+at90can_poll_sent(void)
 {
-    while (true)
+    for (uint8_t mob = 8; mob < 15; mob++)
     {
-        // check if there is any free MOb
-        if (at90can_free_buffer != 0)
+        CANPAGE = mob << 4;
+        if (CANSTMOB & (1 << TXOK))
         {
-            for (uint8_t mob = 8; mob < 15; mob++)
-            {
-                // load MOb page
-                CANPAGE = mob << 4;
+            // clear MOb
+            CANSTMOB &= 0;
+            CANCDMOB &= 0;
+
+            at90can_tx_free |= 1 << (mob - 8);
+        }
+    }
 
-                // check if the MOb is in use
-                if ((CANCDMOB & ((1 << CONMOB1) | (1 << CONMOB0))) == 0)
+    at90can_send_queued();
+}
+#endif
+
+bool
+at90can_wait_sent(uint16_t timeout)
+{
+    uint16_t start = CANTIM;
+
+    // messages are only queued while all MObs are used
+    while (at90can_tx_free != 0x7F)
+    {
+#if BOOT_POLLED
+        at90can_poll_sent();
+#endif
+        if ((uint16_t) (CANTIM - start) >= timeout)
+        {
+            // No acknowledge (e.g. no other node on the bus), abort the
+            // pending transmissions and drop the queue
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+            {
+                for (uint8_t mob = 8; mob < 15; mob++)
                 {
-                    at90can_write_message(type, length, mob);
-                    return;
+                    if (!(at90can_tx_free & (1 << (mob - 8))))
+                    {
+                        CANPAGE = mob << 4;
+                        CANCDMOB = 0;
+                        CANSTMOB &= 0;
+#if !BOOT_POLLED
+                        CANIE1 &= ~(1 << (mob - 8));
+#endif
+                    }
                 }
+                at90can_tx_free = 0x7F;
+                at90can_tx_count = 0;
+                at90can_tx_tail = at90can_tx_head;
             }
+            return false;
         }
     }
+    return true;
+}
+
+void
+at90can_send_message(command_t type, uint8_t length)
+{
+#if BOOT_MULTICAST
+    if (message_multicast) {
+        return;
+    }
+#endif
+
+    // wait for a free entry, the interrupt sends the queued messages as
+    // soon as a MOb gets free
+    while (at90can_tx_count >= CAN_TX_QUEUE_SIZE) {
+#if BOOT_POLLED
+        at90can_poll_sent();
+#endif
+    }
+
+    at90can_tx_message_t *msg = &at90can_tx_queue[at90can_tx_head];
+    msg->type    = (uint8_t) type;
+    msg->length  = length;
+    msg->number  = message_number;
+    msg->counter = message_data_counter;
+#if BOOT_BOARD_IDENTIFIERS
+    msg->board_identifier = message_board_identifier;
+#endif
+    memcpy(msg->data, message_data, length);
+
+    at90can_tx_head = (at90can_tx_head + 1) % CAN_TX_QUEUE_SIZE;
+
+    TRACE(TRACE_TX, type);
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        at90can_tx_count++;
+        at90can_send_queued();
+    }
 }
@@ -8,6 +8,22 @@
  */
 
 #define BOOTLOADER_TYPE         2
+//#define   BOOT_STREAMING_FILL     1
+//#define   BOOT_EXTENDED_DATA      1
+//#define   BOOT_COMPRESSED_DATA    1
+//#define   BOOT_MULTICAST          1
+//#define   BOOT_AUTOBAUD           1
+//#define   BOOT_AUTOBAUD_STORE     1
+//#define   BOOT_FAST_START         1
+//#define   BOOT_DATA_OFFSET        1
+//#define   BOOT_BOARD_IDENTIFIERS  1
+//#define   BOOT_POLLED             1
+//#define   BOOT_SESSION_BITRATE    1
+//#define   BOOT_ACK_INTERVAL       1
+//#define   BOOT_PATCH_PAGE         1
+//#define   BOOT_STAGING            1
+//#define   BOOT_STATS              1
+//#define   BOOT_TRACE              1
 //#define   BOOT_LED                E,4
 
 //#define   BOOT_LED                A,5
@@ -29,6 +29,18 @@
 #define EEPROM_BOARD_ID_ADDRESS     ((uint8_t *)(E2END - 1))
 #define EEPROM_BITRATE_ADDRESS      ((uint8_t *)(E2END - 2))
 
+// Length of the boot window in units of 10 ms, 0 or 0xff select the
+// default of 500 ms
+#define EEPROM_BOOT_WINDOW_ADDRESS  ((uint8_t *)(E2END - 3))
+
+// Request and response identifier of the board (big endian), 0xffff
+// selects the identifiers derived from the board id
+#define EEPROM_IDENTIFIER_ADDRESS   ((uint8_t *)(E2END - 7))
+
+// CRC of the application checked with BOOT_FAST_START, 0xffff after the
+// flash was changed
+#define EEPROM_APP_CRC_ADDRESS      ((uint16_t *)(E2END - 9))
+
 // check defines for the bootloader led
 #ifdef BOOT_LED
 
@@ -80,6 +92,168 @@
     #define BOOTLOADER_TYPE     0
 #endif
 
+// Accept DATA frames with 29-bit identifiers. Board id, message number and
+// data counter are moved into the identifier so that all eight data bytes
+// carry payload.
+#ifndef BOOT_EXTENDED_DATA
+    #define BOOT_EXTENDED_DATA      0
+#endif
+
+// Fill the temporary page buffer of the SPM unit directly with the
+// received data instead of collecting a page in SRAM first. Saves the
+// SRAM page buffers but disables the background page write.
+#ifndef BOOT_STREAMING_FILL
+    #define BOOT_STREAMING_FILL     0
+#endif
+
+// Accept COMPRESSED_DATA messages which are decoded into the page buffer
+// (see lz.h). Needs the SRAM page buffers, the decoder copies data from
+// already received parts of the page.
+#ifndef BOOT_COMPRESSED_DATA
+    #define BOOT_COMPRESSED_DATA    0
+#endif
+
+// Accept programming groups: a DATA stream sent to the multicast board
+// id is received by all boards of a group (see JOIN_GROUP). Received
+// pages are recorded, the host repairs missing ones with GROUP_STATUS and
+// normal unicast transfers.
+#ifndef BOOT_MULTICAST
+    #define BOOT_MULTICAST          0
+#endif
+
+// Detect the bitrate of the bus at startup. The stored bitrate is tried
+// first, then all others until a frame is received without errors. The
+// search is limited to the boot window, if the bus stays silent the
+// stored bitrate is used.
+#ifndef BOOT_AUTOBAUD
+    #define BOOT_AUTOBAUD           0
+#endif
+
+// Store a detected bitrate in the EEPROM
+#ifndef BOOT_AUTOBAUD_STORE
+    #define BOOT_AUTOBAUD_STORE     0
+#endif
+
+// Start a valid application directly after a reset without waiting for
+// the host. The bootloader only stays active after an external reset or
+// if the application descriptor is missing or doesn't match.
+#ifndef BOOT_FAST_START
+    #define BOOT_FAST_START         0
+#endif
+
+// Accept DATA_OFFSET messages which address a four byte slot of the page
+// instead of following each other. They are not numbered, the message
+// number carries the low byte of the page instead. Missing slots are
+// reported to the host which only sends these again.
+#ifndef BOOT_DATA_OFFSET
+    #define BOOT_DATA_OFFSET        0
+#endif
+
+// Receive requests on an identifier of the board instead of the common
+// identifier 0x7ff. The hardware filter drops the traffic of other boards
+// and the identifiers can be chosen to give the transfer a higher
+// priority on the bus. Without stored identifiers they are derived from
+// the board id (see CAN_IDENTIFIER_BOARD_BASE).
+#ifndef BOOT_BOARD_IDENTIFIERS
+    #define BOOT_BOARD_IDENTIFIERS  0
+#endif
+
+// Poll the status of the MObs instead of using the CAN interrupt. The
+// interrupt vectors stay in the application section and the application
+// is started without pending CAN interrupts. Received messages are read
+// in the order of their timestamps.
+#ifndef BOOT_POLLED
+    #define BOOT_POLLED             0
+#endif
+
+// Accept SET_ACK_INTERVAL: DATA transfers are only acknowledged every n
+// pages, so the host can send several pages without waiting. Errors
+// report the first page not stored.
+#ifndef BOOT_ACK_INTERVAL
+    #define BOOT_ACK_INTERVAL       0
+#endif
+
+// Accept PATCH_PAGE: the page buffer is loaded from the flash and only
+// the changed part of the page is transmitted. Needs the SRAM page
+// buffers.
+#ifndef BOOT_PATCH_PAGE
+    #define BOOT_PATCH_PAGE         0
+#endif
+
+// Accept COMMIT_STAGED: an image written into the staging area (upper
+// half of the application section) is copied over the application after
+// its descriptor and CRC were checked. The application stays bootable
+// while the image is transferred. The running application can fill the
+// staging area itself and request the copy with a reset, see
+// app/bootloader_entry.h. Needs the SRAM page buffers.
+#ifndef BOOT_STAGING
+    #define BOOT_STAGING            0
+#endif
+
+// Accept SESSION_BITRATE to switch to another bitrate until the bootloader
+// is left. The previous bitrate is restored if the host doesn't confirm
+// the new one with a message within 500 ms.
+#ifndef BOOT_SESSION_BITRATE
+    #define BOOT_SESSION_BITRATE    0
+#endif
+
+// Count received frames, errors and written pages, see stats.h. The
+// counters are read with the STATS command.
+#ifndef BOOT_STATS
+    #define BOOT_STATS              0
+#endif
+
+// Debug build: record received and sent messages, SPM operations and
+// state changes with timestamps, see trace.h. The events are read with
+// TRACE_DUMP.
+#ifndef BOOT_TRACE
+    #define BOOT_TRACE              0
+#endif
+
+// Number of events kept by BOOT_TRACE (at most 128, four bytes each)
+#ifndef TRACE_SIZE
+    #define TRACE_SIZE              64
+#endif
+
+#if BOOT_COMPRESSED_DATA && BOOT_STREAMING_FILL
+    #error "BOOT_COMPRESSED_DATA can't be used together with BOOT_STREAMING_FILL"
+#endif
+
+#if BOOT_PATCH_PAGE && BOOT_STREAMING_FILL
+    #error "BOOT_PATCH_PAGE can't be used together with BOOT_STREAMING_FILL"
+#endif
+
+#if BOOT_STAGING && BOOT_STREAMING_FILL
+    #error "BOOT_STAGING can't be used together with BOOT_STREAMING_FILL"
+#endif
+
+// Optional features are reported in the upper bits of the pagesize
+// identifier in the IDENTIFY response
+#define FEATURE_EXTENDED_DATA       0x80
+#define FEATURE_COMPRESSED_DATA     0x40
+#define FEATURE_MULTICAST           0x20
+#define FEATURE_FAST_START          0x10
+#define FEATURE_DATA_OFFSET         0x08
+
+#define BOOTLOADER_FEATURES     ((BOOT_EXTENDED_DATA ? FEATURE_EXTENDED_DATA : 0) | \
+                                 (BOOT_COMPRESSED_DATA ? FEATURE_COMPRESSED_DATA : 0) | \
+                                 (BOOT_MULTICAST ? FEATURE_MULTICAST : 0) | \
+                                 (BOOT_FAST_START ? FEATURE_FAST_START : 0) | \
+                                 (BOOT_DATA_OFFSET ? FEATURE_DATA_OFFSET : 0))
+
+#if BOOT_EXTENDED_DATA
+    #define MESSAGE_DATA_LENGTH_MAX 8
+#else
+    #define MESSAGE_DATA_LENGTH_MAX 4
+#endif
+
+// Maximum number of pages for READ_FLASH_RANGE. The data is sent as one
+// block, which is limited to 128 messages by the data counter.
+#define READ_FLASH_RANGE_PAGES  ((128 * MESSAGE_DATA_LENGTH_MAX) / SPM_PAGESIZE)
+
+// ERASE_RANGE reports the progress after every ERASE_PROGRESS_PAGES pages
+#define ERASE_PROGRESS_PAGES    16
+
 // set current version of the bootloader
 #define BOOTLOADER_VERSION      3
 
@@ -117,10 +291,72 @@
     #error  choosen F_CPU not supported yet!
 #endif
 
+// Timer ticks for the boot window stored in the EEPROM
+#define TIMER_TICKS_10MS        ((F_CPU / 1024) / 100)
+
+// Time to listen for frames with one bitrate during the bitrate
+// detection, all eight bitrates fit into the boot window.
+#define AUTOBAUD_TIMEOUT        ((uint16_t) (65536UL - TIMER_PRELOAD) / 10)
+
+
+// The application descriptor occupies the last eight bytes of the
+// application section (little endian):
+//
+//   0..1   APP_DESCRIPTOR_MAGIC
+//   2..5   length of the application in bytes
+//   6..7   CRC-16 (CCITT, see flash_crc()) of the application
+#define APP_DESCRIPTOR_ADDRESS      ((uint32_t) RWW_PAGES * SPM_PAGESIZE - 8)
+#define APP_DESCRIPTOR_MAGIC        0x5AA5
+
+// Staging area of BOOT_STAGING: the upper half of the application
+// section without the last page, which holds the application descriptor.
+// The staged image is followed by its descriptor at the end of the area.
+#define STAGING_PAGE                (RWW_PAGES / 2)
+#define STAGING_PAGES               (RWW_PAGES - 1 - STAGING_PAGE)
+#define STAGING_DESCRIPTOR_ADDRESS  ((uint32_t) (STAGING_PAGE + STAGING_PAGES) * SPM_PAGESIZE - 8)
+
+// Replaces APP_DESCRIPTOR_MAGIC while the staged image is copied, an
+// interrupted copy is finished after the next reset
+#define STAGING_COPY_MAGIC          0xC0A7
 
 #define CAN_IDENTIFIER_SEND         0x7FE
 #define CAN_IDENTIFIER_RECEIVE      0x7FF
 
+// Identifiers derived from the board id: requests are received with
+// CAN_IDENTIFIER_BOARD_BASE + 2 * board id, responses are sent with the
+// following identifier.
+#ifndef CAN_IDENTIFIER_BOARD_BASE
+    #define CAN_IDENTIFIER_BOARD_BASE   0x500
+#endif
+
+// Upper five bits of the 29-bit identifiers. The remaining bits contain
+// the board id, the message number (type for responses) and the data
+// counter.
+#define CAN_EXTENDED_PREFIX_SEND    0x1E
+#define CAN_EXTENDED_PREFIX_RECEIVE 0x1F
+
+// Number of MObs receiving extended DATA frames, the remaining
+// receive MObs are used for standard frames.
+#define CAN_EXTENDED_MOBS           4
+
+#if BOOT_EXTENDED_DATA
+    #define CAN_STANDARD_MOBS       (8 - CAN_EXTENDED_MOBS)
+#else
+    #define CAN_STANDARD_MOBS       8
+#endif
+
+// Number of the last receive MObs which stay on CAN_IDENTIFIER_RECEIVE
+// with BOOT_BOARD_IDENTIFIERS. START_BOOTLOADER, the scan of the host and
+// programming groups use the common identifier.
+#define CAN_COMMON_MOBS             (CAN_STANDARD_MOBS / 2)
+
+// Number of messages which can be queued for sending
+#define CAN_TX_QUEUE_SIZE           8
+
+// Time to wait for the acknowledge of sent messages before they are
+// discarded, in ticks of the CAN timer (100 us).
+#define CAN_TX_TIMEOUT              1000
+
 #define MULTICAST_BOARD_ID      0
 
 #endif  // DEFAULTS_H
@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2010, 2015-2017 Fabian Greif.
+ * All rights reserved.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <stddef.h>
+
+#include <avr/io.h>
+#include <avr/boot.h>
+#include <avr/pgmspace.h>
+
+#include <util/crc16.h>
+
+#include "flash.h"
+#include "stats.h"
+#include "trace.h"
+
+#if FLASHEND > 0xffff
+    #define flash_read_byte(address)    pgm_read_byte_far(address)
+#else
+    #define flash_read_byte(address)    pgm_read_byte((uint16_t) (address))
+#endif
+
+static enum
+{
+    FLASH_IDLE,
+    FLASH_ERASE,        //!< Page erase in progress
+    FLASH_WRITE,        //!< Page write in progress
+    FLASH_ERASE_RANGE   //!< Erase of a range of pages in progress
+} flash_state = FLASH_IDLE;
+
+static uint32_t flash_address;
+static const uint8_t *flash_buffer;
+
+// Pages of flash_erase_range() not finished, including the current one
+static uint16_t flash_erase_count;
+
+#if BOOT_STATS
+// Value of the CAN timer (100 us) at the start of the current operation
+static uint16_t flash_started;
+
+    #define FLASH_STARTED()     flash_started = CANTIM
+#else
+    #define FLASH_STARTED()
+#endif
+
+#if BOOT_STREAMING_FILL
+
+void
+flash_erase_page(uint16_t page)
+{
+    flash_wait();
+
+    // Writing RWWSRE also clears the temporary page buffer
+    boot_rww_enable();
+
+    flash_address = (uint32_t) page * SPM_PAGESIZE;
+    flash_buffer = NULL;
+
+    FLASH_STARTED();
+    TRACE(TRACE_ERASE, page);
+    boot_page_erase(flash_address);
+    flash_state = FLASH_ERASE;
+}
+
+void
+flash_fill(uint16_t page, uint16_t offset, const uint8_t *data, uint8_t length)
+{
+    // The page erase has to be finished before the buffer can be filled
+    flash_wait();
+
+    uint32_t address = (uint32_t) page * SPM_PAGESIZE + offset;
+    for (uint8_t i = 0; i < length; i += 2)
+    {
+        // Set up little-endian word.
+        uint16_t w = *data++;
+        w |= (*data++) << 8;
+
+        boot_page_fill(address + i, w);
+    }
+}
+
+void
+flash_write_page_buffer(uint16_t page)
+{
+    flash_wait();
+
+    flash_address = (uint32_t) page * SPM_PAGESIZE;
+
+    FLASH_STARTED();
+    TRACE(TRACE_WRITE, page);
+    boot_page_write(flash_address);
+    flash_state = FLASH_WRITE;
+}
+
+#else
+
+uint8_t
+flash_write_page(uint16_t page, const uint8_t *buf)
+{
+    flash_wait();
+
+    flash_address = (uint32_t) page * SPM_PAGESIZE;
+    flash_buffer = buf;
+
+    uint8_t status = FLASH_WRITE_SKIPPED | FLASH_ERASE_SKIPPED;
+    for (uint16_t i = 0; i < SPM_PAGESIZE; i++)
+    {
+        uint8_t value = flash_read_byte(flash_address + i);
+        if (value != buf[i]) {
+            status &= ~FLASH_WRITE_SKIPPED;
+        }
+        if (value != 0xff) {
+            status &= ~FLASH_ERASE_SKIPPED;
+        }
+    }
+
+    if (status & FLASH_WRITE_SKIPPED)
+    {
+        // nothing to do
+        return FLASH_WRITE_SKIPPED | FLASH_ERASE_SKIPPED;
+    }
+
+    FLASH_STARTED();
+    if (!(status & FLASH_ERASE_SKIPPED))
+    {
+        TRACE(TRACE_ERASE, page);
+        boot_page_erase(flash_address);
+    }
+
+    // flash_process() fills the buffer after the (optional) erase
+    flash_state = FLASH_ERASE;
+    return status;
+}
+
+#endif
+
+/**
+ * Start the erase of the page at flash_address, skips blank pages.
+ */
+static void
+flash_erase_next(void)
+{
+    // the RWW section has to be readable for the blank check
+    boot_rww_enable();
+
+    FLASH_STARTED();
+
+    for (uint16_t i = 0; i < SPM_PAGESIZE; i++)
+    {
+        if (flash_read_byte(flash_address + i) != 0xff)
+        {
+            TRACE(TRACE_ERASE, flash_address / SPM_PAGESIZE);
+            boot_page_erase(flash_address);
+            return;
+        }
+    }
+}
+
+void
+flash_erase_range(uint16_t page, uint16_t count)
+{
+    flash_wait();
+
+    flash_address = (uint32_t) page * SPM_PAGESIZE;
+    flash_erase_count = count;
+    flash_state = FLASH_ERASE_RANGE;
+
+    flash_erase_next();
+}
+
+uint16_t
+flash_erase_remaining(void)
+{
+    if (flash_state == FLASH_ERASE_RANGE) {
+        return flash_erase_count;
+    }
+    return 0;
+}
+
+void
+flash_read(uint32_t address, uint8_t *data, uint8_t length)
+{
+    while (length--)
+    {
+        *data++ = flash_read_byte(address++);
+    }
+}
+
+uint16_t
+flash_crc_range(uint32_t address, uint32_t length)
+{
+    uint16_t crc = 0xffff;
+
+    uint32_t end = address + length;
+    for (; address < end; address++)
+    {
+        crc = _crc_ccitt_update(crc, flash_read_byte(address));
+    }
+
+    return crc;
+}
+
+uint16_t
+flash_crc(uint16_t page, uint16_t count)
+{
+    return flash_crc_range((uint32_t) page * SPM_PAGESIZE,
+                           (uint32_t) count * SPM_PAGESIZE);
+}
+
+/**
+ * \see     avr-libc Documentation > Modules > Bootloader Support Utilities
+ */
+void
+flash_process(void)
+{
+    if (flash_state == FLASH_IDLE || boot_spm_busy())
+    {
+        return;
+    }
+
+#if BOOT_STATS
+    stats.spm_time += (uint16_t) (CANTIM - flash_started);
+#endif
+    TRACE(TRACE_SPM_DONE, 0);
+
+    if (flash_state == FLASH_ERASE_RANGE)
+    {
+        // The current page is erased, continue with the next one
+        flash_address += SPM_PAGESIZE;
+        if (--flash_erase_count > 0)
+        {
+            flash_erase_next();
+            return;
+        }
+
+        boot_rww_enable();
+        flash_state = FLASH_IDLE;
+    }
+    else if (flash_state == FLASH_ERASE && flash_buffer != NULL)
+    {
+        // The page is erased, the temporary page buffer can be filled now
+        const uint8_t *buf = flash_buffer;
+        for (uint16_t i = 0; i < SPM_PAGESIZE; i += 2)
+        {
+            // Set up little-endian word.
+            uint16_t w = *buf++;
+            w |= (*buf++) << 8;
+
+            boot_page_fill(flash_address + i, w);
+        }
+
+        FLASH_STARTED();
+        TRACE(TRACE_WRITE, flash_address / SPM_PAGESIZE);
+        boot_page_write(flash_address);     // Store buffer in flash page.
+        flash_state = FLASH_WRITE;
+    }
+    else
+    {
+        // Reenable RWW-section again. We need this if we want to jump back
+        // to the application after loading the application.
+        boot_rww_enable();
+        flash_state = FLASH_IDLE;
+    }
+}
+
+bool
+flash_idle(void)
+{
+    return (flash_state == FLASH_IDLE);
+}
+
+void
+flash_wait(void)
+{
+    while (flash_state != FLASH_IDLE)
+    {
+        flash_process();
+    }
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2010, 2015-2017 Fabian Greif.
+ * All rights reserved.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef FLASH_H
+#define FLASH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "defaults.h"
+
+// Flags returned by flash_write_page()
+#define FLASH_WRITE_SKIPPED     0x01    //!< Page content was unchanged
+#define FLASH_ERASE_SKIPPED     0x02    //!< Page was already blank
+
+#if BOOT_STREAMING_FILL
+
+/**
+ * Start erasing a page.
+ *
+ * Any data already stored in the temporary page buffer is discarded.
+ * Waits for a previous operation to finish first.
+ */
+void
+flash_erase_page(uint16_t page);
+
+/**
+ * Copy data directly into the temporary page buffer.
+ *
+ * Every word of the temporary page buffer can only be written once
+ * until the buffer is written to the flash or discarded.
+ *
+ * \param   page    page which is filled
+ * \param   offset  Offset within the page in bytes (must be even)
+ * \param   *data   Pointer to the data
+ * \param   length  Number of bytes to copy (must be even)
+ */
+void
+flash_fill(uint16_t page, uint16_t offset, const uint8_t *data, uint8_t length);
+
+/**
+ * Start writing the temporary page buffer to a page.
+ *
+ * The page has to be erased before, see flash_erase_page().
+ */
+void
+flash_write_page_buffer(uint16_t page);
+
+#else
+
+/**
+ * Start writing a complete page to the flash memory.
+ *
+ * Only the page erase is started here, the rest of the programming is
+ * done by flash_process() while the SPM unit is otherwise idle. If a
+ * previous page is still being written this function waits until it is
+ * finished.
+ *
+ * The page is not written at all if the flash already contains the same
+ * data, and the erase is skipped if the page is blank.
+ *
+ * The buffer must not be modified until the write has finished, see
+ * flash_wait().
+ *
+ * \param   page    page which should be written
+ * \param   *buf    Pointer to the buffer with the data
+ * \return  FLASH_WRITE_SKIPPED and/or FLASH_ERASE_SKIPPED
+ */
+uint8_t
+flash_write_page(uint16_t page, const uint8_t *buf);
+
+#endif
+
+/**
+ * Start erasing a range of pages.
+ *
+ * The pages are erased one after the other by flash_process(), pages
+ * which are already blank are skipped. Waits for a previous operation to
+ * finish first.
+ *
+ * \param   page    first page
+ * \param   count   number of pages (at least one)
+ */
+void
+flash_erase_range(uint16_t page, uint16_t count);
+
+/**
+ * Number of pages of flash_erase_range() which are not erased yet.
+ *
+ * \return  0 if the erase is finished
+ */
+uint16_t
+flash_erase_remaining(void);
+
+/**
+ * Read bytes from the flash memory.
+ *
+ * Uses far reads, so the complete flash is reachable. No page write must
+ * be pending, see flash_wait().
+ */
+void
+flash_read(uint32_t address, uint8_t *data, uint8_t length);
+
+/**
+ * Calculate the CRC-16 (CCITT) of a range of pages.
+ *
+ * Uses _crc_ccitt_update() from avr-libc with a start value of 0xffff.
+ * No page write must be pending, see flash_wait().
+ *
+ * \param   page    first page
+ * \param   count   number of pages
+ */
+uint16_t
+flash_crc(uint16_t page, uint16_t count);
+
+/**
+ * Calculate the CRC-16 (CCITT) of a range of bytes.
+ *
+ * Same calculation as flash_crc().
+ */
+uint16_t
+flash_crc_range(uint32_t address, uint32_t length);
+
+/**
+ * Advance the background page write.
+ *
+ * Must be called regularly from the main loop. Returns immediately if
+ * the SPM unit is still busy.
+ */
+void
+flash_process(void);
+
+/**
+ * Check for a pending page write or erase.
+ *
+ * \return  true if the SPM unit is idle
+ */
+bool
+flash_idle(void);
+
+/**
+ * Wait until a pending page write has finished.
+ *
+ * Afterwards the RWW section is readable again and the buffer passed to
+ * flash_write_page() is no longer in use.
+ */
+void
+flash_wait(void);
+
+#endif // FLASH_H
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2010, 2015-2017 Fabian Greif.
+ * All rights reserved.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <avr/io.h>
+
+#include "lz.h"
+
+#if BOOT_COMPRESSED_DATA
+
+static uint8_t *lz_buffer;
+static uint16_t lz_pos;
+static uint8_t  lz_literals;    //!< Literal bytes still to copy
+static uint8_t  lz_match;       //!< Length of a match waiting for its distance
+
+void
+lz_init(uint8_t *buffer, uint16_t position)
+{
+    lz_buffer = buffer;
+    lz_pos = position;
+    lz_literals = 0;
+    lz_match = 0;
+}
+
+bool
+lz_decode(const uint8_t *data, uint8_t length)
+{
+    while (length--)
+    {
+        uint8_t c = *data++;
+
+        if (lz_literals)
+        {
+            lz_buffer[lz_pos++] = c;
+            lz_literals--;
+        }
+        else if (lz_match)
+        {
+            uint16_t distance = c + 1;
+            if (distance > lz_pos) {
+                return false;
+            }
+
+            // byte by byte, the source may overlap with the destination
+            uint8_t *dst = lz_buffer + lz_pos;
+            const uint8_t *src = dst - distance;
+            lz_pos += lz_match;
+            do {
+                *dst++ = *src++;
+            } while (--lz_match);
+        }
+        else
+        {
+            uint8_t count;
+            if (c & 0x80) {
+                count = (c & 0x7f) + 2;
+            }
+            else {
+                count = c + 1;
+            }
+
+            if (count > SPM_PAGESIZE - lz_pos) {
+                return false;
+            }
+
+            if (c & 0x80) {
+                lz_match = count;
+            }
+            else {
+                lz_literals = count;
+            }
+        }
+    }
+
+    return true;
+}
+
+uint16_t
+lz_position(void)
+{
+    return lz_pos;
+}
+
+#endif
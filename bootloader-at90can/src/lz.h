@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2010, 2015-2017 Fabian Greif.
+ * All rights reserved.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+/**
+ * \file
+ * \brief   Decoder for COMPRESSED_DATA messages
+ *
+ * A compressed page is a sequence of tokens:
+ *
+ * - 0x00..0x7f: literal run, the following (token + 1) bytes are copied
+ *   to the page.
+ * - 0x80..0xff: match, (token & 0x7f) + 2 bytes are copied from the
+ *   already decoded part of the page. The following byte contains the
+ *   distance - 1 (1..256 bytes back). Source and destination may overlap,
+ *   a distance of one repeats the last byte.
+ *
+ * Tokens may span several messages.
+ */
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "defaults.h"
+
+#if BOOT_COMPRESSED_DATA
+
+/**
+ * Start decoding into a page buffer.
+ *
+ * \param   *buffer     page buffer (SPM_PAGESIZE bytes)
+ * \param   position    start position within the buffer in bytes
+ */
+void
+lz_init(uint8_t *buffer, uint16_t position);
+
+/**
+ * Decode the next part of the compressed stream.
+ *
+ * \return  false if the stream would write beyond the end of the page
+ *          or references data before the start of the page
+ */
+bool
+lz_decode(const uint8_t *data, uint8_t length);
+
+/**
+ * Number of bytes decoded into the page buffer.
+ *
+ * The page is complete when SPM_PAGESIZE is reached.
+ */
+uint16_t
+lz_position(void);
+
+#endif
+
+#endif // LZ_H
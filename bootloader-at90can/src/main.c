@@ -26,9 +26,16 @@
 #include <avr/interrupt.h>
 
 #include <util/delay.h>
+#include <util/atomic.h>
 
 #include "at90can.h"
 #include "defaults.h"
+#include "flash.h"
+#include "lz.h"
+#include "stats.h"
+#include "trace.h"
+
+#include "../app/bootloader_entry.h"
 
 // Page number of the flash currently being written
 static uint16_t flashpage = 0;
@@ -36,8 +43,73 @@ static uint16_t flashpage = 0;
 // Current read/write position within the flash page
 static uint8_t  flashpage_buffer_pos = 0;
 
-// Buffer for the flash page content
-static uint8_t  flashpage_buffer[SPM_PAGESIZE];
+#if BOOT_STREAMING_FILL
+// The current page is erased, the temporary page buffer can be filled
+static bool     flashpage_erased = false;
+#endif
+
+// Write position for EEPROM_DATA
+static uint16_t eeprom_position = 0;
+
+#if BOOT_STATS
+stats_t stats;
+#endif
+
+#if BOOTLOADER_TYPE > 0
+// Remaining pages of the last progress report of ERASE_RANGE, zero if
+// no erase is reported
+static uint16_t erase_reported = 0;
+#endif
+
+#if BOOT_STAGING
+// Copy of the staged image (see COMMIT_STAGED): next page and number of
+// pages, the copy is running while they differ
+static uint16_t staging_copy_page = 0;
+static uint16_t staging_copy_pages = 0;
+#endif
+
+#if BOOT_DATA_OFFSET
+// One bit for every four byte slot of the page received with DATA_OFFSET
+static uint8_t  flashpage_slots[SPM_PAGESIZE / 4 / 8];
+
+// Page last written with DATA_OFFSET and the flags of its ACK, which is
+// repeated if the host didn't receive it
+static uint16_t data_offset_page = 0xFFFF;
+static uint8_t  data_offset_flags;
+#endif
+
+#if BOOT_PATCH_PAGE
+// End of the part of the page replaced with PATCH_PAGE (in units of four
+// bytes), zero while a complete page is collected
+static uint8_t  patch_end = 0;
+#endif
+
+#if BOOT_ACK_INTERVAL
+// Pages written with DATA are acknowledged every ack_interval pages (see
+// SET_ACK_INTERVAL). Pages written and pages with a skipped write since
+// the last acknowledge.
+static uint8_t  ack_interval = 1;
+static uint8_t  ack_pending = 0;
+static uint8_t  ack_skipped = 0;
+
+// Set after the first error of a DATA message while several pages are in
+// flight. The following DATA messages are dropped without a response
+// until the host restarts the transfer with SET_ADDRESS, SET_ACK_INTERVAL
+// or PATCH_PAGE.
+static bool     data_error_sent = false;
+#endif
+
+#if BOOT_MULTICAST
+// One bit for every page which was written since JOIN_GROUP
+static uint8_t  flashpage_received[(RWW_PAGES + 7) / 8];
+#endif
+
+#if !BOOT_STREAMING_FILL
+// Buffers for the flash page content. While one buffer is written to the
+// flash in the background the next page is collected in the other one.
+static uint8_t  flashpage_buffers[2][SPM_PAGESIZE];
+static uint8_t *flashpage_buffer = flashpage_buffers[0];
+#endif
 
 // Watchdog Timer als erstes im Programm deaktivieren
 // see http://www.nongnu.org/avr-libc/user-manual/group__avr__watchdog.html
@@ -52,6 +124,26 @@ disable_watchdog(void)
     GPIOR0 = MCUSR;
     MCUSR = 0;
     wdt_disable();
+
+    // Check whether the application requested the bootloader (see
+    // app/bootloader_entry.h). The stack is not used yet, so the value at
+    // the end of the SRAM is still intact.
+    GPIOR1 = 0;
+    if ((GPIOR0 & (1 << WDRF)) &&
+        (*BOOTLOADER_ENTRY_ADDRESS == BOOTLOADER_ENTRY_MAGIC))
+    {
+        GPIOR1 = 1;
+    }
+#if BOOT_STAGING
+    // the staged image is copied before the application is started
+    // again, see main()
+    if ((GPIOR0 & (1 << WDRF)) &&
+        (*BOOTLOADER_ENTRY_ADDRESS == BOOTLOADER_COMMIT_MAGIC))
+    {
+        GPIOR1 = 2;
+    }
+#endif
+    *BOOTLOADER_ENTRY_ADDRESS = 0;
 }
 
 /**
@@ -60,11 +152,13 @@ disable_watchdog(void)
 static void
 boot_jump_to_application(void)
 {
+#if !BOOT_POLLED
     // relocate interrupt vectors
     uint8_t reg = MCUCR & ~((1 << IVCE) | (1 << IVSEL));
 
     MCUCR = reg | (1 << IVCE);
     MCUCR = reg;
+#endif
 
 #if FLASHEND > 0xffff
     __asm__ __volatile__(
@@ -83,38 +177,304 @@ boot_jump_to_application(void)
     // application.
 }
 
+#if BOOT_FAST_START || BOOT_STAGING
+// Application descriptor, see APP_DESCRIPTOR_ADDRESS
+typedef struct
+{
+    uint16_t magic;
+    uint32_t length;
+    uint16_t crc;
+} boot_descriptor_t;
+#endif
+
+#if BOOT_FAST_START
 /**
- * Write a complete page to the flash memory
+ * Check the application descriptor.
  *
- * \param   page    page which should be written
- * \param   *buf    Pointer to the buffer with the data
+ * The CRC of the application is only calculated after the flash was
+ * changed. A matching CRC is stored in the EEPROM, afterwards the check
+ * of the descriptor is sufficient.
  *
- * \see     avr-libc Documentation > Modules > Bootloader Support Utilities
+ * \return  true if the descriptor is present and the CRC of the
+ *          application matches
  */
-static void
-boot_program_page(uint16_t page, uint8_t *buf)
+static bool
+boot_application_valid(void)
 {
-    uint32_t address = page * SPM_PAGESIZE;
+    boot_descriptor_t descriptor;
 
-    boot_page_erase(address);
-    boot_spm_busy_wait();       // Wait until the memory is erased.
+    flash_read(APP_DESCRIPTOR_ADDRESS, (uint8_t *) &descriptor, sizeof(descriptor));
 
-    for (uint16_t i = 0; i < SPM_PAGESIZE; i += 2)
+    if (descriptor.magic != APP_DESCRIPTOR_MAGIC ||
+        descriptor.length == 0 ||
+        descriptor.length > APP_DESCRIPTOR_ADDRESS)
     {
-        // Set up little-endian word.
-        uint16_t w = *buf++;
-        w |= (*buf++) << 8;
+        return false;
+    }
+
+    uint16_t checked = eeprom_read_word(EEPROM_APP_CRC_ADDRESS);
+    if (checked != 0xFFFF && checked == descriptor.crc) {
+        return true;
+    }
+
+    if (flash_crc_range(0, descriptor.length) != descriptor.crc) {
+        return false;
+    }
+
+    eeprom_write_word(EEPROM_APP_CRC_ADDRESS, descriptor.crc);
+    eeprom_busy_wait();
+    return true;
+}
+
+/**
+ * Clear the checked CRC before the flash is changed.
+ */
+static void
+boot_application_changed(void)
+{
+    if (eeprom_read_word(EEPROM_APP_CRC_ADDRESS) != 0xFFFF)
+    {
+        // the EEPROM can't be written while the SPM unit is busy
+        flash_wait();
+        eeprom_write_word(EEPROM_APP_CRC_ADDRESS, 0xFFFF);
+        eeprom_busy_wait();
+    }
+}
+#endif
+
+/**
+ * Send the response to IDENTIFY.
+ *
+ * The data counter reports the number of receive MObs for the identifier
+ * of the request. Blocks of messages which are not processed at once
+ * (e.g. EEPROM_DATA) are limited to it by the host.
+ */
+static void
+boot_send_identify(void)
+{
+#if BOOT_BOARD_IDENTIFIERS
+    if (message_board_identifier) {
+        message_data_counter = START_OF_MESSAGE_MASK | (CAN_STANDARD_MOBS - CAN_COMMON_MOBS);
+    }
+    else {
+        message_data_counter = START_OF_MESSAGE_MASK | CAN_COMMON_MOBS;
+    }
+#else
+    message_data_counter = START_OF_MESSAGE_MASK | CAN_STANDARD_MOBS;
+#endif
+
+    // version and command of the bootloader
+    message_data[0] = (BOOTLOADER_TYPE << 4) | (BOOTLOADER_VERSION & 0x0f);
+    message_data[1] = PAGESIZE_IDENTIFIER | BOOTLOADER_FEATURES;
+
+    // number of writeable pages
+    message_data[2] = (RWW_PAGES) >> 8;
+    message_data[3] = (RWW_PAGES) & 0xFF;
+
+    at90can_send_message(IDENTIFY | SUCCESSFULL_RESPONSE, 4);
+}
+
+#if BOOT_STREAMING_FILL
+/**
+ * Erase the current page before its first data is filled in.
+ *
+ * The page following a written page is only erased when the host
+ * continues with it, pages behind the image stay untouched.
+ *
+ * \return  false if the page lies outside of the application section
+ */
+static bool
+boot_erase_collected_page(void)
+{
+    if (flashpage_erased) {
+        return true;
+    }
+    if (flashpage >= RWW_PAGES) {
+        return false;
+    }
+
+#if BOOT_FAST_START
+    boot_application_changed();
+#endif
+    flash_erase_page(flashpage);
+    flashpage_erased = true;
+    return true;
+}
+#endif
+
+/**
+ * Start writing the collected page to the flash and continue with the
+ * next page.
+ *
+ * Fills in the response to the last DATA message of the page: the page
+ * number and the flags returned by flash_write_page().
+ *
+ * \return  false if the page lies outside of the application section
+ */
+static bool
+boot_write_collected_page(void)
+{
+    message_data[0] = flashpage >> 8;
+    message_data[1] = flashpage & 0xff;
 
-        boot_page_fill(address + i, w);
+    if (flashpage >= RWW_PAGES) {
+        return false;
     }
 
-    boot_page_write(address);   // Store buffer in flash page.
-    boot_spm_busy_wait();       // Wait until the memory is written.
+#if BOOT_STREAMING_FILL
+    // The page was erased before its first data, it is always written
+    message_data[2] = 0;
+    STATS_INC(pages_written);
+    flash_write_page_buffer(flashpage);
+    flash_wait();
+    flashpage_erased = false;
+#else
+#if BOOT_FAST_START
+    // With BOOT_STREAMING_FILL this happens when the page is erased, an
+    // EEPROM write discards the temporary page buffer
+    boot_application_changed();
+#endif
+    // Start writing the page in the background and
+    // collect the next page in the other buffer
+    message_data[2] = flash_write_page(flashpage, flashpage_buffer);
+#if BOOT_STATS
+    if (message_data[2] & FLASH_WRITE_SKIPPED) {
+        stats.pages_skipped++;
+    }
+    else {
+        stats.pages_written++;
+    }
+#endif
+    if (flashpage_buffer == flashpage_buffers[0]) {
+        flashpage_buffer = flashpage_buffers[1];
+    }
+    else {
+        flashpage_buffer = flashpage_buffers[0];
+    }
+#endif
+#if BOOT_MULTICAST
+    flashpage_received[flashpage / 8] |= 1 << (flashpage % 8);
+#endif
+#if BOOT_DATA_OFFSET
+    memset(flashpage_slots, 0, sizeof(flashpage_slots));
+#endif
+#if BOOT_PATCH_PAGE
+    patch_end = 0;
+#endif
+    flashpage_buffer_pos = 0;
+    flashpage += 1;
+
+#if BOOT_COMPRESSED_DATA
+    lz_init(flashpage_buffer, 0);
+#endif
+    return true;
+}
+
+#if BOOT_PATCH_PAGE || BOOT_STAGING
+/**
+ * Read a page into the page buffer.
+ */
+static void
+boot_read_page(uint16_t page)
+{
+    // flash_read() reads at most 255 bytes at once
+    uint32_t address = (uint32_t) page * SPM_PAGESIZE;
+    flash_read(address, flashpage_buffer, SPM_PAGESIZE / 2);
+    flash_read(address + SPM_PAGESIZE / 2,
+               flashpage_buffer + SPM_PAGESIZE / 2, SPM_PAGESIZE / 2);
+}
+#endif
+
+#if BOOT_STAGING
+/**
+ * Read the descriptor of the staged image.
+ *
+ * \return  true if the staging area holds an image with a matching
+ *          length and CRC
+ */
+static bool
+boot_staged_valid(boot_descriptor_t *descriptor)
+{
+    uint32_t start = (uint32_t) STAGING_PAGE * SPM_PAGESIZE;
+
+    flash_read(STAGING_DESCRIPTOR_ADDRESS, (uint8_t *) descriptor, sizeof(*descriptor));
+
+    return (descriptor->magic == APP_DESCRIPTOR_MAGIC &&
+            descriptor->length != 0 &&
+            descriptor->length <= STAGING_DESCRIPTOR_ADDRESS - start &&
+            flash_crc_range(start, descriptor->length) == descriptor->crc);
+}
+
+/**
+ * Write the descriptor of the application, the rest of the last page is
+ * kept.
+ */
+static void
+boot_write_descriptor(const boot_descriptor_t *descriptor)
+{
+    flash_wait();
+    boot_read_page(RWW_PAGES - 1);
+    memcpy(flashpage_buffer + SPM_PAGESIZE - sizeof(*descriptor), descriptor, sizeof(*descriptor));
+    flash_write_page(RWW_PAGES - 1, flashpage_buffer);
+    flash_wait();
+}
+
+/**
+ * Start copying the staged image over the application.
+ *
+ * The descriptor of the application is replaced with STAGING_COPY_MAGIC
+ * first. The application isn't started with it and an interrupted copy
+ * is started again after the next reset. The pages are copied by
+ * boot_copy_next_page().
+ */
+static void
+boot_start_copy(boot_descriptor_t *descriptor)
+{
+#if BOOT_FAST_START
+    boot_application_changed();
+#endif
+    descriptor->magic = STAGING_COPY_MAGIC;
+    boot_write_descriptor(descriptor);
+
+    staging_copy_page = 0;
+    staging_copy_pages = (descriptor->length + SPM_PAGESIZE - 1) / SPM_PAGESIZE;
+}
+
+/**
+ * Copy the next page of the staged image, the descriptor of the
+ * application is restored after the last one.
+ *
+ * Waits for the previous page first, the staging area can't be read
+ * while a page is written.
+ */
+static void
+boot_copy_next_page(void)
+{
+    flash_wait();
+    boot_read_page(STAGING_PAGE + staging_copy_page);
+    flash_write_page(staging_copy_page, flashpage_buffer);
+
+    if (++staging_copy_page == staging_copy_pages)
+    {
+        boot_descriptor_t descriptor;
+
+        flash_wait();
+        flash_read(STAGING_DESCRIPTOR_ADDRESS, (uint8_t *) &descriptor, sizeof(descriptor));
+        boot_write_descriptor(&descriptor);
+    }
+}
 
-    // Reenable RWW-section again. We need this if we want to jump back
-    // to the application after loading the application.
-    boot_rww_enable();
+/**
+ * Copy the remaining pages of a running copy.
+ */
+static void
+boot_finish_copy(void)
+{
+    while (staging_copy_page != staging_copy_pages) {
+        boot_copy_next_page();
+    }
 }
+#endif
 
 int
 main(void) __attribute__((OS_main));
@@ -126,19 +486,52 @@ main(void)
     {
         IDLE,
         COLLECT_DATA,
+        COLLECT_EEPROM_DATA,
         RECEIVED_PAGE
     } state = IDLE;
     uint8_t next_message_number = -1;
 
+#if BOOT_STAGING
+    // Copy the staged image on request of the application or finish an
+    // interrupted copy. No host is involved, the copy is done before
+    // anything else.
+    {
+        boot_descriptor_t descriptor;
+
+        flash_read(APP_DESCRIPTOR_ADDRESS, (uint8_t *) &descriptor, sizeof(descriptor));
+        if ((GPIOR1 == 2 || descriptor.magic == STAGING_COPY_MAGIC) &&
+            boot_staged_valid(&descriptor))
+        {
+            boot_start_copy(&descriptor);
+            boot_finish_copy();
+        }
+
+        if (GPIOR1 == 2) {
+            GPIOR1 = 0;
+        }
+    }
+#endif
+
+#if BOOT_FAST_START
+    // Skip the boot window if the application is valid, unless the
+    // bootloader was requested with the reset pin or by the application
+    if (!(GPIOR0 & (1 << EXTRF)) && !GPIOR1 && boot_application_valid())
+    {
+        boot_jump_to_application();
+    }
+#endif
+
     // Do some addition initialization (if required)
     BOOT_INIT;
 
     BOOT_LED_SET_OUTPUT;
     BOOT_LED_ON;
 
+#if !BOOT_POLLED
     // Relocate interrupt vectors to boot area
     MCUCR = (1 << IVCE);
     MCUCR = (1 << IVSEL);
+#endif
 
     uint8_t board_id = eeprom_read_byte(EEPROM_BOARD_ID_ADDRESS);
     if (board_id == 0xFF)
@@ -150,29 +543,167 @@ main(void)
         message_board_id = board_id;
     }
 
-    uint8_t bitrate = eeprom_read_byte(EEPROM_BITRATE_ADDRESS);
-    at90can_init(bitrate);
+#if BOOT_BOARD_IDENTIFIERS
+    // request and response identifier of the board (see SET_IDENTIFIERS)
+    uint8_t identifiers[4];
+    eeprom_read_block(identifiers, EEPROM_IDENTIFIER_ADDRESS, 4);
+    message_identifier_receive = (identifiers[0] << 8) | identifiers[1];
+    message_identifier_send    = (identifiers[2] << 8) | identifiers[3];
+    if (message_identifier_receive == 0xFFFF)
+    {
+        message_identifier_receive = CAN_IDENTIFIER_BOARD_BASE + 2 * message_board_id;
+        message_identifier_send    = message_identifier_receive + 1;
+    }
+#endif
 
-    // Start timer
-    TCNT1 = TIMER_PRELOAD;
+    // Start timer, the length of the boot window can be changed in the
+    // EEPROM (see SET_BOOT_WINDOW)
+    uint8_t window = eeprom_read_byte(EEPROM_BOOT_WINDOW_ADDRESS);
+    if (window == 0 || window == 0xFF)
+    {
+        TCNT1 = TIMER_PRELOAD;
+    }
+    else
+    {
+        TCNT1 = (uint16_t) (65536UL - window * TIMER_TICKS_10MS);
+    }
     TCCR1A = 0;
     TCCR1B = TIMER_PRESCALER;
 
     // Clear overflow-flag
     TIFR1 = (1 << TOV1);
 
+    uint8_t bitrate = eeprom_read_byte(EEPROM_BITRATE_ADDRESS);
+
+#if BOOT_AUTOBAUD
+    // Listen with every bitrate until a valid frame is received, starting
+    // with the stored one. Uses the boot window, the application is started
+    // as usual if the bus stays silent.
+    uint8_t rate = (bitrate > BITRATE_1_MBPS) ? BITRATE_125_KBPS : bitrate;
+    while (!GPIOR1 && !(TIFR1 & (1 << TOV1)))
+    {
+        at90can_listen(rate);
+
+        int8_t status = 0;
+        uint16_t start = TCNT1;
+        while ((status == 0)
+               && ((uint16_t) (TCNT1 - start) < AUTOBAUD_TIMEOUT)
+               && !(TIFR1 & (1 << TOV1)))
+        {
+            status = at90can_listen_status();
+        }
+
+        if (status > 0)
+        {
+# if BOOT_AUTOBAUD_STORE
+            if (rate != bitrate) {
+                eeprom_write_byte(EEPROM_BITRATE_ADDRESS, rate);
+            }
+# endif
+            bitrate = rate;
+            break;
+        }
+
+        rate = (rate + 1) % (BITRATE_1_MBPS + 1);
+    }
+#endif
+
+    at90can_init(bitrate);
+
+#if !BOOT_POLLED
     sei();
+#endif
+
+#if BOOT_SESSION_BITRATE
+    // bitrate used before SESSION_BITRATE until the host confirms the
+    // new one, 0xff if confirmed
+    uint8_t session_fallback = 0xFF;
+#endif
+
+    if (GPIOR1)
+    {
+        // The bootloader was requested by the application and the host is
+        // already waiting: announce the bootloader and wait for the host
+        // without a timeout.
+        TCCR1B = 0;
+        TIFR1 = (1 << TOV1);
+
+        message_number = next_message_number;
+        boot_send_identify();
+    }
 
     while (1)
     {
         uint8_t command;
         static uint8_t next_message_data_counter;
 
+#if BOOT_TRACE
+        static uint8_t traced_state = IDLE;
+        if (state != traced_state)
+        {
+            TRACE(TRACE_STATE, state);
+            traced_state = state;
+        }
+#endif
+
         // wait until we receive a new message
         while ((command = at90can_get_message()) == NO_MESSAGE)
         {
+            // continue a page write while there is nothing else to do
+            flash_process();
+
+#if BOOTLOADER_TYPE > 0
+            // Report the progress of ERASE_RANGE. No other message was
+            // received since, the response still belongs to the request.
+            if (erase_reported != 0)
+            {
+                uint16_t remaining = flash_erase_remaining();
+                if (remaining == 0 ||
+                    remaining + ERASE_PROGRESS_PAGES <= erase_reported)
+                {
+                    message_data[0] = remaining >> 8;
+                    message_data[1] = remaining & 0xff;
+                    at90can_send_message(ERASE_RANGE | SUCCESSFULL_RESPONSE, 2);
+
+                    erase_reported = remaining;
+                }
+            }
+#endif
+#if BOOT_STAGING
+            // Copy the staged image while the SPM unit is idle, the
+            // progress is reported like for ERASE_RANGE
+            if (staging_copy_page != staging_copy_pages && flash_idle())
+            {
+                boot_copy_next_page();
+
+                uint16_t remaining = staging_copy_pages - staging_copy_page;
+                if (remaining % ERASE_PROGRESS_PAGES == 0)
+                {
+                    message_data[0] = remaining >> 8;
+                    message_data[1] = remaining & 0xff;
+                    at90can_send_message(COMMIT_STAGED | SUCCESSFULL_RESPONSE, 2);
+                }
+            }
+#endif
+
             if (TIFR1 & (1 << TOV1))
             {
+#if BOOT_SESSION_BITRATE
+                if (session_fallback != 0xFF)
+                {
+                    // the host didn't confirm the session bitrate
+                    TCCR1B = 0;
+                    TIFR1 = (1 << TOV1);
+
+                    bitrate = session_fallback;
+                    session_fallback = 0xFF;
+                    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+                    {
+                        at90can_init(bitrate);
+                    }
+                    continue;
+                }
+#endif
                 BOOT_LED_OFF;
 
                 // timeout => start application
@@ -182,6 +713,20 @@ main(void)
 
         // stop timer
         TCCR1B = 0;
+#if BOOT_SESSION_BITRATE
+        session_fallback = 0xFF;
+#endif
+
+        STATS_INC(frames_received);
+
+#if BOOTLOADER_TYPE > 0
+        // the next command finishes a running erase (see flash_wait())
+        erase_reported = 0;
+#endif
+#if BOOT_STAGING
+        // and a running copy of the staged image
+        boot_finish_copy();
+#endif
 
         // check if the message is a request, otherwise reject it
         if ((command & ~COMMAND_MASK) != REQUEST)
@@ -196,33 +741,64 @@ main(void)
             continue;
         }
 
-        // check message number
-        next_message_number++;
-        if (message_number != next_message_number)
+#if BOOT_MULTICAST
+        if (message_multicast)
         {
-            // wrong message number => send NACK
-            message_number = next_message_number;
-            next_message_number--;
-            at90can_send_message(command | WRONG_NUMBER_REPSONSE, 0);
-            continue;
+            // Group messages are not numbered and never answered. Only the
+            // transfer of a program is possible, lost pages are detected
+            // with GROUP_STATUS afterwards.
+            if (command != SET_ADDRESS && command != DATA &&
+                command != COMPRESSED_DATA && command != START_APP)
+            {
+                continue;
+            }
+        }
+        else
+#endif
+#if BOOT_DATA_OFFSET
+        // DATA_OFFSET messages are not numbered, lost messages are
+        // reported in the response and sent again by the host
+        if (command != DATA_OFFSET)
+#endif
+        {
+            // check message number
+            next_message_number++;
+            if (message_number != next_message_number)
+            {
+                // wrong message number => send NACK
+                message_number = next_message_number;
+                next_message_number--;
+#if BOOT_ACK_INTERVAL
+                if (command == DATA && ack_interval > 1)
+                {
+                    if (data_error_sent) {
+                        continue;
+                    }
+                    data_error_sent = true;
+                }
+#endif
+                STATS_INC(sequence_errors);
+                at90can_send_message(command | WRONG_NUMBER_REPSONSE, 0);
+                continue;
+            }
         }
 
         BOOT_LED_TOGGLE;
 
+        // Only new data can be collected while a page is written in the
+        // background. All other commands need access to the flash or the
+        // EEPROM and therefore have to wait until the SPM unit is idle.
+        if (command != DATA && command != COMPRESSED_DATA && command != DATA_OFFSET)
+        {
+            flash_wait();
+        }
+
         // process command
         switch (command)
         {
         case IDENTIFY:
         {
-            // version and command of the bootloader
-            message_data[0] = (BOOTLOADER_TYPE << 4) | (BOOTLOADER_VERSION & 0x0f);
-            message_data[1] = PAGESIZE_IDENTIFIER;
-
-            // number of writeable pages
-            message_data[2] = (RWW_PAGES) >> 8;
-            message_data[3] = (RWW_PAGES) & 0xFF;
-
-            at90can_send_message(IDENTIFY | SUCCESSFULL_RESPONSE, 4);
+            boot_send_identify();
             break;
         }
         // set the current address in the page buffer
@@ -235,8 +811,40 @@ main(void)
                 && (page < RWW_PAGES)
                 && (bufferpos < (SPM_PAGESIZE / 4)))
             {
+#if BOOT_STREAMING_FILL
+                // The temporary page buffer can only be filled once. A page
+                // is therefore (re)started at position zero, which erases
+                // it and discards the buffer. Any other position must
+                // continue exactly where the last transfer stopped.
+                if (bufferpos == 0)
+                {
+#if BOOT_FAST_START
+                    boot_application_changed();
+#endif
+                    flash_erase_page(page);
+                    flashpage_erased = true;
+                }
+                else if ((page != flashpage) || (bufferpos != flashpage_buffer_pos))
+                {
+                    goto error_response;
+                }
+#endif
                 flashpage = page;
                 flashpage_buffer_pos = bufferpos;
+#if BOOT_COMPRESSED_DATA
+                lz_init(flashpage_buffer, bufferpos * 4);
+#endif
+#if BOOT_DATA_OFFSET
+                memset(flashpage_slots, 0, sizeof(flashpage_slots));
+#endif
+#if BOOT_ACK_INTERVAL
+                ack_pending = 0;
+                ack_skipped = 0;
+                data_error_sent = false;
+#endif
+#if BOOT_PATCH_PAGE
+                patch_end = 0;
+#endif
 
                 state = COLLECT_DATA;
 
@@ -251,12 +859,16 @@ main(void)
         // collect data
         case DATA:
         {
-            if (message_data_length != 4 ||
-                flashpage_buffer_pos >= (SPM_PAGESIZE / 4) ||
-                state == IDLE)
+            // Standard frames carry four bytes, extended frames eight
+            if ((message_data_length != 4 && message_data_length != MESSAGE_DATA_LENGTH_MAX) ||
+                flashpage_buffer_pos + message_data_length / 4 > (SPM_PAGESIZE / 4) ||
+#if BOOT_PATCH_PAGE
+                (patch_end != 0 && flashpage_buffer_pos + message_data_length / 4 > patch_end) ||
+#endif
+                state != COLLECT_DATA)
             {
                 state = IDLE;
-                goto error_response;
+                goto data_error_response;
             }
 
             // check if the message starts a new block
@@ -269,47 +881,341 @@ main(void)
 
             if (message_data_counter != next_message_data_counter)
             {
+                STATS_INC(sequence_errors);
                 state = IDLE;
-                goto error_response;
+                goto data_error_response;
             }
             next_message_data_counter--;
 
             // copy data
-            memcpy(flashpage_buffer + flashpage_buffer_pos * 4, &message_data[0], 4);
-            flashpage_buffer_pos++;
+#if BOOT_STREAMING_FILL
+            if (!boot_erase_collected_page()) {
+                state = IDLE;
+                goto data_error_response;
+            }
+            flash_fill(flashpage, flashpage_buffer_pos * 4, &message_data[0], message_data_length);
+#else
+            memcpy(flashpage_buffer + flashpage_buffer_pos * 4, &message_data[0], message_data_length);
+#endif
+            flashpage_buffer_pos += message_data_length / 4;
 
             if (message_data_counter == 0)
             {
-                if (flashpage_buffer_pos == (SPM_PAGESIZE / 4))
+                // A patched page is complete at the end of the patch
+                if (flashpage_buffer_pos == (SPM_PAGESIZE / 4)
+#if BOOT_PATCH_PAGE
+                    || flashpage_buffer_pos == patch_end
+#endif
+                    )
                 {
-                    message_data[0] = flashpage >> 8;
-                    message_data[1] = flashpage & 0xff;
-
-                    if (flashpage >= RWW_PAGES) {
+                    if (!boot_write_collected_page()) {
                         message_data_length = 2;
                         goto error_response;
                     }
 
-                    boot_program_page( flashpage, flashpage_buffer );
-                    flashpage_buffer_pos = 0;
-                    flashpage += 1;
-
-                    // send ACK
-                    at90can_send_message(DATA | SUCCESSFULL_RESPONSE, 2);
+#if BOOT_ACK_INTERVAL
+                    // Only every ack_interval pages are acknowledged, the
+                    // fourth byte counts the skipped writes since the last
+                    // acknowledge
+                    if (message_data[2] & FLASH_WRITE_SKIPPED) {
+                        ack_skipped++;
+                    }
+                    if (++ack_pending < ack_interval) {
+                        break;
+                    }
+                    message_data[3] = ack_skipped;
+                    ack_pending = 0;
+                    ack_skipped = 0;
+
+                    at90can_send_message(DATA | SUCCESSFULL_RESPONSE, 4);
+#else
+                    // send ACK, the data is safely stored. The third byte
+                    // reports whether the erase and/or write were skipped.
+                    at90can_send_message(DATA | SUCCESSFULL_RESPONSE, 3);
+#endif
                 }
                 else {
                     at90can_send_message(DATA | SUCCESSFULL_RESPONSE, 0);
                 }
             }
             break;
+
+        data_error_response:
+#if BOOT_ACK_INTERVAL
+            // only the first error of the pages in flight is reported
+            if (ack_interval > 1)
+            {
+                if (data_error_sent) {
+                    break;
+                }
+                data_error_sent = true;
+            }
+
+            // report the first page which isn't stored, the host continues
+            // there
+            message_data[0] = flashpage >> 8;
+            message_data[1] = flashpage & 0xff;
+            message_data_length = 2;
+#endif
+            goto error_response;
+        }
+#if BOOT_COMPRESSED_DATA
+        // collect compressed data, see lz.h for the format
+        case COMPRESSED_DATA:
+        {
+            if (message_data_length == 0 || message_data_length > 4 ||
+                state != COLLECT_DATA)
+            {
+                state = IDLE;
+                goto error_response;
+            }
+
+            // check if the message starts a new block
+            if (message_data_counter & START_OF_MESSAGE_MASK)
+            {
+                message_data_counter &= ~START_OF_MESSAGE_MASK;     // clear flag
+                next_message_data_counter = message_data_counter;
+                state = COLLECT_DATA;
+            }
+
+            if (message_data_counter != next_message_data_counter ||
+                !lz_decode(&message_data[0], message_data_length))
+            {
+                state = IDLE;
+                goto error_response;
+            }
+            next_message_data_counter--;
+
+            if (message_data_counter == 0)
+            {
+                if (lz_position() == SPM_PAGESIZE)
+                {
+                    if (!boot_write_collected_page()) {
+                        message_data_length = 2;
+                        goto error_response;
+                    }
+                    at90can_send_message(COMPRESSED_DATA | SUCCESSFULL_RESPONSE, 3);
+                }
+                else {
+                    at90can_send_message(COMPRESSED_DATA | SUCCESSFULL_RESPONSE, 0);
+                }
+            }
+            break;
         }
+#endif
+#if BOOT_DATA_OFFSET
+        // collect four bytes at the slot given by the data counter. A
+        // message with DATA_OFFSET_RESPOND set is answered, either with the
+        // ACK of the written page or with the slots still missing. The
+        // message number contains the low byte of the page, responses
+        // repeat it.
+        case DATA_OFFSET:
+        {
+            uint8_t slot = message_data_counter & ~DATA_OFFSET_RESPOND;
+
+            if ((message_data_length != 0 && message_data_length != 4) ||
+                slot >= (SPM_PAGESIZE / 4))
+            {
+                goto error_response;
+            }
+
+            if (message_number != (uint8_t) flashpage)
+            {
+                // A message of the page written last is a repetition after
+                // a lost ACK, the ACK is sent again. Other messages of a
+                // wrong page are dropped.
+                if ((message_data_counter & DATA_OFFSET_RESPOND) &&
+                    (message_number == (uint8_t) data_offset_page))
+                {
+                    message_data[0] = data_offset_page >> 8;
+                    message_data[1] = data_offset_page & 0xff;
+                    message_data[2] = data_offset_flags;
+                    at90can_send_message(DATA_OFFSET | SUCCESSFULL_RESPONSE, 3);
+                }
+                break;
+            }
+
+            if (state != COLLECT_DATA) {
+                goto error_response;
+            }
+
+            // repeated slots are ignored, every word of the temporary page
+            // buffer can only be written once
+            uint8_t mask = 1 << (slot % 8);
+            if (message_data_length != 0 && !(flashpage_slots[slot / 8] & mask))
+            {
+#if BOOT_STREAMING_FILL
+                if (!boot_erase_collected_page()) {
+                    goto error_response;
+                }
+                flash_fill(flashpage, slot * 4, &message_data[0], 4);
+#else
+                memcpy(flashpage_buffer + slot * 4, &message_data[0], 4);
+#endif
+                flashpage_slots[slot / 8] |= mask;
+            }
+
+            if (message_data_counter & DATA_OFFSET_RESPOND)
+            {
+                uint8_t first = 0;
+                while ((first < (SPM_PAGESIZE / 4)) &&
+                       (flashpage_slots[first / 8] & (1 << (first % 8))))
+                {
+                    first++;
+                }
+
+                if (first == (SPM_PAGESIZE / 4))
+                {
+                    if (!boot_write_collected_page()) {
+                        message_data_length = 2;
+                        goto error_response;
+                    }
+                    data_offset_page = flashpage - 1;
+                    data_offset_flags = message_data[2];
+                    at90can_send_message(DATA_OFFSET | SUCCESSFULL_RESPONSE, 3);
+                }
+                else
+                {
+                    // first missing slot and a bitmap of the missing slots
+                    // starting with it (bit 0 of byte 1)
+                    message_data[0] = first;
+                    message_data[1] = 0;
+                    message_data[2] = 0;
+                    message_data[3] = 0;
+                    for (uint8_t i = 0; i < 24; i++)
+                    {
+                        uint8_t s = first + i;
+                        if ((s < (SPM_PAGESIZE / 4)) &&
+                            !(flashpage_slots[s / 8] & (1 << (s % 8))))
+                        {
+                            message_data[1 + i / 8] |= 1 << (i % 8);
+                        }
+                    }
+                    at90can_send_message(DATA_OFFSET | SUCCESSFULL_RESPONSE, 4);
+                }
+            }
+            break;
+        }
+#endif
+#if BOOT_MULTICAST
+        // join a programming group (or leave it with group id zero)
+        case JOIN_GROUP:
+        {
+            if (message_data_length == 1)
+            {
+                message_group_id = message_data[0];
+                memset(flashpage_received, 0, sizeof(flashpage_received));
+
+                at90can_send_message(JOIN_GROUP | SUCCESSFULL_RESPONSE, 0);
+            }
+            else
+            {
+                goto error_response;
+            }
+            break;
+        }
+        // find the first page starting at the given one which was not
+        // written since JOIN_GROUP, RWW_PAGES if there is none
+        case GROUP_STATUS:
+        {
+            uint16_t page = (message_data[0] << 8) | message_data[1];
+
+            if (message_data_length == 2)
+            {
+                for (; page < RWW_PAGES; page++)
+                {
+                    if (!(flashpage_received[page / 8] & (1 << (page % 8)))) {
+                        break;
+                    }
+                }
+                if (page > RWW_PAGES) {
+                    page = RWW_PAGES;
+                }
+
+                message_data[0] = page >> 8;
+                message_data[1] = page & 0xff;
+
+                at90can_send_message(GROUP_STATUS | SUCCESSFULL_RESPONSE, 2);
+            }
+            else
+            {
+                goto error_response;
+            }
+            break;
+        }
+#endif
+#if BOOT_PATCH_PAGE
+        // Replace a part of a page: the page buffer is loaded with the
+        // content of the flash, the following DATA messages overwrite
+        // `length` words (four bytes) starting at `offset`. The page is
+        // written after the last one.
+        case PATCH_PAGE:
+        {
+            uint16_t page = (message_data[0] << 8) | message_data[1];
+            uint8_t offset = message_data[2];
+            uint8_t length = message_data[3];
+
+            if ((message_data_length == 4) && (page < RWW_PAGES) &&
+                (length != 0) && (offset + length <= (SPM_PAGESIZE / 4)))
+            {
+                boot_read_page(page);
+
+                flashpage = page;
+                flashpage_buffer_pos = offset;
+                patch_end = offset + length;
+                state = COLLECT_DATA;
+#if BOOT_ACK_INTERVAL
+                data_error_sent = false;
+#endif
+
+                at90can_send_message(PATCH_PAGE | SUCCESSFULL_RESPONSE, 4);
+            }
+            else
+            {
+                goto error_response;
+            }
+            break;
+        }
+#endif
+#if BOOT_ACK_INTERVAL
+        // Acknowledge only every n-th page written with DATA. The response
+        // contains the next page to be written, all pages before are
+        // stored (the pending write was finished above).
+        case SET_ACK_INTERVAL:
+        {
+            if ((message_data_length == 1) && (message_data[0] != 0))
+            {
+                ack_interval = message_data[0];
+                ack_pending = 0;
+                ack_skipped = 0;
+                data_error_sent = false;
+
+                message_data[0] = flashpage >> 8;
+                message_data[1] = flashpage & 0xff;
+                at90can_send_message(SET_ACK_INTERVAL | SUCCESSFULL_RESPONSE, 2);
+            }
+            else
+            {
+                goto error_response;
+            }
+            break;
+        }
+#endif
         // start the flashed application program
         case START_APP:
         {
             at90can_send_message(START_APP | SUCCESSFULL_RESPONSE, 0);
 
-            // wait for the mcp2515 to send the message
+            // wait for the queued messages to be sent
+#if BOOT_POLLED
+            for (uint8_t i = 0; i < 50; i++)
+            {
+                at90can_poll_sent();
+                _delay_ms(1);
+            }
+#else
             _delay_ms(50);
+#endif
 
             // start application
             BOOT_LED_OFF;
@@ -328,8 +1234,8 @@ main(void)
                 && (page < RWW_PAGES)
                 && (bufferpos < (SPM_PAGESIZE / 4)))
             {
-                uint16_t address = page * SPM_PAGESIZE + bufferpos * 4;
-                memcpy_P(&message_data[0], (const void *) address, 4);
+                uint32_t address = (uint32_t) page * SPM_PAGESIZE + bufferpos * 4;
+                flash_read(address, &message_data[0], 4);
 
                 at90can_send_message(READ_FLASH | SUCCESSFULL_RESPONSE, 4);
             }
@@ -339,6 +1245,63 @@ main(void)
             }
             break;
         }
+        // Read a range of pages, the content is sent as one block of
+        // messages numbered with the data counter
+        case READ_FLASH_RANGE:
+        {
+            uint16_t page = (message_data[0] << 8) | message_data[1];
+            uint16_t count = (message_data[2] << 8) | message_data[3];
+
+            if ((message_data_length == 4)
+                && (count > 0)
+                && (count <= READ_FLASH_RANGE_PAGES)
+                && (page < RWW_PAGES)
+                && (count <= RWW_PAGES - page))
+            {
+                uint32_t address = (uint32_t) page * SPM_PAGESIZE;
+                uint8_t frames = count * (SPM_PAGESIZE / MESSAGE_DATA_LENGTH_MAX);
+
+                message_data_counter = START_OF_MESSAGE_MASK | (frames - 1);
+                do {
+                    flash_read(address, &message_data[0], MESSAGE_DATA_LENGTH_MAX);
+                    address += MESSAGE_DATA_LENGTH_MAX;
+
+                    at90can_send_message(READ_FLASH_RANGE | SUCCESSFULL_RESPONSE,
+                                         MESSAGE_DATA_LENGTH_MAX);
+
+                    message_data_counter = (message_data_counter & ~START_OF_MESSAGE_MASK) - 1;
+                } while (--frames);
+            }
+            else
+            {
+                goto error_response;
+            }
+            break;
+        }
+        // Calculate the CRC of a range of pages
+        case FLASH_CRC:
+        {
+            uint16_t page = (message_data[0] << 8) | message_data[1];
+            uint16_t count = (message_data[2] << 8) | message_data[3];
+
+            if ((message_data_length == 4)
+                && (count > 0)
+                && (page < RWW_PAGES)
+                && (count <= RWW_PAGES - page))
+            {
+                uint16_t crc = flash_crc(page, count);
+
+                message_data[0] = crc >> 8;
+                message_data[1] = crc & 0xff;
+
+                at90can_send_message(FLASH_CRC | SUCCESSFULL_RESPONSE, 2);
+            }
+            else
+            {
+                goto error_response;
+            }
+            break;
+        }
         case GET_FUSEBITS:
         {
             message_data[0] = boot_lock_fuse_bits_get(GET_LOCK_BITS);
@@ -352,16 +1315,69 @@ main(void)
         case CHIP_ERASE:
         {
             // erase complete flash except the bootloader region
-            for (uint16_t page = 0; page < RWW_PAGES; ++page)
+#if BOOT_FAST_START
+            boot_application_changed();
+#endif
+            flash_erase_range(0, RWW_PAGES);
+            flash_wait();
+
+            at90can_send_message(CHIP_ERASE | SUCCESSFULL_RESPONSE, 0);
+            break;
+        }
+# if BOOT_STAGING
+        // Check the CRC of the staged image and copy it over the
+        // application in the background. The number of remaining pages
+        // is reported at the start, after every ERASE_PROGRESS_PAGES
+        // pages and at the end (zero).
+        case COMMIT_STAGED:
+        {
+            boot_descriptor_t descriptor;
+
+            // the page buffer is used for the copy
+            state = IDLE;
+
+            if ((message_data_length == 0) && boot_staged_valid(&descriptor))
             {
-                uint32_t address = page * SPM_PAGESIZE;
+                boot_start_copy(&descriptor);
 
-                boot_page_erase(address);
-                boot_spm_busy_wait();
+                message_data[0] = staging_copy_pages >> 8;
+                message_data[1] = staging_copy_pages & 0xff;
+                at90can_send_message(COMMIT_STAGED | SUCCESSFULL_RESPONSE, 2);
+            }
+            else
+            {
+                goto error_response;
             }
-            boot_rww_enable();
+            break;
+        }
+# endif
 
-            at90can_send_message(CHIP_ERASE | SUCCESSFULL_RESPONSE, 0);
+        // Erase a range of pages in the background. The number of
+        // remaining pages is reported at the start, after every
+        // ERASE_PROGRESS_PAGES pages and at the end (zero).
+        case ERASE_RANGE:
+        {
+            uint16_t page  = (message_data[0] << 8) | message_data[1];
+            uint16_t count = (message_data[2] << 8) | message_data[3];
+
+            if ((message_data_length == 4) &&
+                (count > 0) && (page < RWW_PAGES) &&
+                (count <= RWW_PAGES - page))
+            {
+#if BOOT_FAST_START
+                boot_application_changed();
+#endif
+                flash_erase_range(page, count);
+
+                erase_reported = count;
+                message_data[0] = message_data[2];
+                message_data[1] = message_data[3];
+                at90can_send_message(ERASE_RANGE | SUCCESSFULL_RESPONSE, 2);
+            }
+            else
+            {
+                goto error_response;
+            }
             break;
         }
         // Read 1..4 Byte from the EEPROM
@@ -400,6 +1416,101 @@ main(void)
             }
             break;
         }
+        // set the start address for EEPROM_DATA
+        case SET_EEPROM_ADDRESS:
+        {
+            uint16_t eeprom_address = (message_data[0] << 8) | message_data[1];
+
+            if ((message_data_length == 2) && (eeprom_address <= E2END))
+            {
+                eeprom_position = eeprom_address;
+                state = COLLECT_EEPROM_DATA;
+
+                at90can_send_message(SET_EEPROM_ADDRESS | SUCCESSFULL_RESPONSE, 2);
+            }
+            else
+            {
+                goto error_response;
+            }
+            break;
+        }
+        // write a block of 1..4 byte messages to the EEPROM, cells which
+        // already contain the data are not written again
+        case EEPROM_DATA:
+        {
+            if (message_data_length == 0 || message_data_length > 4 ||
+                message_data_length > E2END + 1 - eeprom_position ||
+                state != COLLECT_EEPROM_DATA)
+            {
+                state = IDLE;
+                goto error_response;
+            }
+
+            // check if the message starts a new block
+            if (message_data_counter & START_OF_MESSAGE_MASK)
+            {
+                message_data_counter &= ~START_OF_MESSAGE_MASK;     // clear flag
+                next_message_data_counter = message_data_counter;
+            }
+
+            if (message_data_counter != next_message_data_counter)
+            {
+                STATS_INC(sequence_errors);
+                state = IDLE;
+                goto error_response;
+            }
+            next_message_data_counter--;
+
+            eeprom_update_block(&message_data[0], (void *) eeprom_position, message_data_length);
+            eeprom_position += message_data_length;
+
+            if (message_data_counter == 0)
+            {
+                // report the next write position
+                message_data[0] = eeprom_position >> 8;
+                message_data[1] = eeprom_position & 0xff;
+
+                at90can_send_message(EEPROM_DATA | SUCCESSFULL_RESPONSE, 2);
+            }
+            break;
+        }
+        // Read a range of the EEPROM, the content is sent as one block of
+        // messages numbered with the data counter
+        case READ_EEPROM_RANGE:
+        {
+            uint16_t eeprom_address = (message_data[0] << 8) | message_data[1];
+            uint16_t length = (message_data[2] << 8) | message_data[3];
+
+            if ((message_data_length == 4)
+                && (length > 0)
+                && (length <= 128 * MESSAGE_DATA_LENGTH_MAX)
+                && (eeprom_address <= E2END)
+                && (length <= E2END + 1 - eeprom_address))
+            {
+                uint8_t frames = (length + MESSAGE_DATA_LENGTH_MAX - 1) / MESSAGE_DATA_LENGTH_MAX;
+
+                message_data_counter = START_OF_MESSAGE_MASK | (frames - 1);
+                do {
+                    uint8_t n = MESSAGE_DATA_LENGTH_MAX;
+                    if (length < n) {
+                        n = length;
+                    }
+
+                    eeprom_read_block(&message_data[0], (void *) eeprom_address, n);
+                    eeprom_address += n;
+                    length -= n;
+
+                    at90can_send_message(READ_EEPROM_RANGE | SUCCESSFULL_RESPONSE, n);
+
+                    message_data_counter = (message_data_counter & ~START_OF_MESSAGE_MASK) - 1;
+                } while (--frames);
+            }
+            else
+            {
+                goto error_response;
+            }
+            break;
+        }
 #endif
 #if BOOTLOADER_TYPE == 2
         case SET_BOARD_ID:
@@ -420,7 +1531,7 @@ main(void)
         case SET_BITRATE:
         {
             uint8_t bitrate = message_data[0];
-            if ((message_data_length == 1) && (bitrate < BITRATE_1_MBPS))
+            if ((message_data_length == 1) && (bitrate <= BITRATE_1_MBPS))
             {
                 eeprom_write_byte(EEPROM_BITRATE_ADDRESS, bitrate);
                 at90can_send_message(SET_BITRATE | SUCCESSFULL_RESPONSE, 0);
@@ -431,6 +1542,131 @@ main(void)
             }
             break;
         }
+
+        // length of the boot window in units of 10 ms (0 = default)
+        case SET_BOOT_WINDOW:
+        {
+            if (message_data_length == 1)
+            {
+                eeprom_write_byte(EEPROM_BOOT_WINDOW_ADDRESS, message_data[0]);
+                at90can_send_message(SET_BOOT_WINDOW | SUCCESSFULL_RESPONSE, 0);
+            }
+            else
+            {
+                goto error_response;
+            }
+            break;
+        }
+
+# if BOOT_BOARD_IDENTIFIERS
+        // request and response identifier of the board, used after the
+        // next reset. 0xffff for both restores the identifiers derived
+        // from the board id.
+        case SET_IDENTIFIERS:
+        {
+            uint16_t receive = (message_data[0] << 8) | message_data[1];
+            uint16_t send    = (message_data[2] << 8) | message_data[3];
+
+            bool reset = (receive == 0xFFFF) && (send == 0xFFFF);
+            if ((message_data_length == 4) &&
+                (reset || ((receive < CAN_IDENTIFIER_SEND) &&
+                           (send < CAN_IDENTIFIER_SEND) &&
+                           (receive != send))))
+            {
+                eeprom_write_block(&message_data[0], EEPROM_IDENTIFIER_ADDRESS, 4);
+                at90can_send_message(SET_IDENTIFIERS | SUCCESSFULL_RESPONSE, 0);
+            }
+            else
+            {
+                goto error_response;
+            }
+            break;
+        }
+# endif
+
+# if BOOT_SESSION_BITRATE
+        // Switch to another bitrate until the bootloader is left. The
+        // response is sent with the current bitrate, the host confirms the
+        // new one with its next message.
+        case SESSION_BITRATE:
+        {
+            uint8_t new_bitrate = message_data[0];
+            if ((message_data_length == 1) && (new_bitrate <= BITRATE_1_MBPS))
+            {
+                at90can_send_message(SESSION_BITRATE | SUCCESSFULL_RESPONSE, 0);
+                if (!at90can_wait_sent(CAN_TX_TIMEOUT))
+                {
+                    // The host didn't receive the response, it keeps
+                    // using the current bitrate
+                    break;
+                }
+
+                // at90can_init() uses 125 kbps for invalid values
+                session_fallback = (bitrate > BITRATE_1_MBPS) ? BITRATE_125_KBPS : bitrate;
+                bitrate = new_bitrate;
+                ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+                {
+                    at90can_init(bitrate);
+                }
+
+                // the previous bitrate is restored after 500 ms
+                TCNT1 = TIMER_PRELOAD;
+                TIFR1 = (1 << TOV1);
+                TCCR1B = TIMER_PRESCALER;
+            }
+            else
+            {
+                goto error_response;
+            }
+            break;
+        }
+# endif
+#endif
+
+#if BOOT_TRACE
+        // stop the recording and report the number of events, or send
+        // the events (data[0] = 1)
+        case TRACE_DUMP:
+        {
+            if (message_data_length == 0)
+            {
+                message_data[0] = trace_stop();
+                at90can_send_message(TRACE_DUMP | SUCCESSFULL_RESPONSE, 1);
+            }
+            else if (message_data_length == 1 && message_data[0] == 1)
+            {
+                trace_dump();
+            }
+            else
+            {
+                goto error_response;
+            }
+            break;
+        }
+#endif
+#if BOOT_STATS
+        // send the counters (see stats_t) as big endian values in a block
+        // of four messages
+        case STATS:
+        {
+            uint16_t values[8];
+            memcpy(values, &stats, 6 * sizeof(uint16_t));
+            values[6] = stats.spm_time >> 16;
+            values[7] = stats.spm_time & 0xffff;
+
+            message_data_counter = START_OF_MESSAGE_MASK | 3;
+            for (uint8_t i = 0; i < 8; i += 2)
+            {
+                message_data[0] = values[i] >> 8;
+                message_data[1] = values[i] & 0xff;
+                message_data[2] = values[i + 1] >> 8;
+                message_data[3] = values[i + 1] & 0xff;
+                at90can_send_message(STATS | SUCCESSFULL_RESPONSE, 4);
+
+                message_data_counter = (message_data_counter & ~START_OF_MESSAGE_MASK) - 1;
+            }
+            break;
+        }
 #endif
 
         error_response:
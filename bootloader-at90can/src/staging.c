@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2010, 2015-2017 Fabian Greif.
+ * All rights reserved.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+/**
+ * \file
+ * \brief   Write access to the staging area for the application
+ *
+ * Only code in the boot section can execute SPM. The application calls
+ * these functions through the jump table in the section .boot_api, which
+ * is placed at BOOT_API_START at the end of the boot section (see the
+ * Makefile and app/bootloader_entry.h).
+ *
+ * The functions run in the context of the application. They must not
+ * use any variables of the bootloader, its .data and .bss sections are
+ * not initialized then.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <avr/io.h>
+#include <avr/boot.h>
+#include <avr/interrupt.h>
+
+#include "defaults.h"
+
+#if BOOT_STAGING
+
+uint16_t
+staging_pages(void) __attribute__((used));
+
+bool
+staging_write_page(uint16_t index, const uint8_t *data) __attribute__((used));
+
+void
+staging_api(void) __attribute__((section(".boot_api"), naked, used));
+
+/**
+ * Number of pages of the staging area.
+ *
+ * The descriptor of the staged image occupies the last eight bytes of
+ * the last page.
+ */
+uint16_t
+staging_pages(void)
+{
+    return STAGING_PAGES;
+}
+
+/**
+ * Erase and write a page of the staging area.
+ *
+ * Interrupts are disabled until the page is written, the interrupt
+ * vectors and the code of the application lie in the RWW section which
+ * can't be read meanwhile.
+ *
+ * \param   index   page within the staging area
+ * \param   *data   content of the page (SPM_PAGESIZE bytes)
+ * \return  false if the page lies outside of the staging area
+ */
+bool
+staging_write_page(uint16_t index, const uint8_t *data)
+{
+    if (index >= STAGING_PAGES) {
+        return false;
+    }
+
+    uint32_t address = (uint32_t) (STAGING_PAGE + index) * SPM_PAGESIZE;
+
+    uint8_t sreg = SREG;
+    cli();
+
+    // SPM is not possible while the EEPROM is written
+    eeprom_busy_wait();
+
+    boot_page_erase(address);
+    boot_spm_busy_wait();
+
+    for (uint16_t i = 0; i < SPM_PAGESIZE; i += 2)
+    {
+        // Set up little-endian word.
+        uint16_t w = *data++;
+        w |= (*data++) << 8;
+
+        boot_page_fill(address + i, w);
+    }
+
+    boot_page_write(address);
+    boot_spm_busy_wait();
+    boot_rww_enable();
+
+    SREG = sreg;
+    return true;
+}
+
+/**
+ * Jump table at BOOT_API_START, the order of the entries must not change.
+ */
+void
+staging_api(void)
+{
+    asm volatile (
+        "jmp %x0"   "\n\t"
+        "jmp %x1"   "\n\t"
+        :: "i" (staging_pages), "i" (staging_write_page));
+}
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2010, 2015-2017 Fabian Greif.
+ * All rights reserved.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+#include "defaults.h"
+
+/**
+ * Counters reported by the STATS command
+ *
+ * All counters start at zero with every start of the bootloader and
+ * wrap around.
+ */
+typedef struct
+{
+    uint16_t frames_received;   //!< Requests for this board
+    uint16_t frames_rejected;   //!< Frames for other boards or with a wrong format
+    uint16_t rx_overruns;       //!< All receive MObs were occupied
+    uint16_t sequence_errors;   //!< Wrong message number or data counter
+    uint16_t pages_written;
+    uint16_t pages_skipped;     //!< Page content was unchanged
+    uint32_t spm_time;          //!< Time the SPM unit was busy (100 us)
+} stats_t;
+
+#if BOOT_STATS
+extern stats_t stats;
+
+#define STATS_INC(counter)      stats.counter++
+#else
+#define STATS_INC(counter)
+#endif
+
+#endif // STATS_H
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2010, 2015-2017 Fabian Greif.
+ * All rights reserved.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <stdbool.h>
+
+#include "at90can.h"
+#include "trace.h"
+
+#if BOOT_TRACE
+
+typedef struct
+{
+    uint16_t time;
+    uint16_t data;          //!< event << 12 | argument
+} trace_entry_t;
+
+static trace_entry_t trace_buffer[TRACE_SIZE];
+static uint8_t trace_position = 0;      //!< Next entry to write
+static uint8_t trace_count = 0;
+static bool trace_stopped = false;
+
+void
+trace_event(uint16_t time, uint8_t event, uint16_t arg)
+{
+    if (trace_stopped) {
+        return;
+    }
+
+    trace_entry_t *entry = &trace_buffer[trace_position];
+    entry->time = time;
+    entry->data = ((uint16_t) event << 12) | (arg & 0x0fff);
+
+    trace_position = (trace_position + 1) % TRACE_SIZE;
+    if (trace_count < TRACE_SIZE) {
+        trace_count++;
+    }
+}
+
+uint8_t
+trace_stop(void)
+{
+    trace_stopped = true;
+    return trace_count;
+}
+
+void
+trace_dump(void)
+{
+    // the messages of the dump are not recorded
+    trace_stopped = true;
+
+    if (trace_count == 0)
+    {
+        message_data_counter = START_OF_MESSAGE_MASK;
+        at90can_send_message(TRACE_DUMP | SUCCESSFULL_RESPONSE, 0);
+    }
+    else
+    {
+        uint8_t index = (trace_position + TRACE_SIZE - trace_count) % TRACE_SIZE;
+
+        message_data_counter = START_OF_MESSAGE_MASK | (trace_count - 1);
+        do {
+            const trace_entry_t *entry = &trace_buffer[index];
+            message_data[0] = entry->time >> 8;
+            message_data[1] = entry->time & 0xff;
+            message_data[2] = entry->data >> 8;
+            message_data[3] = entry->data & 0xff;
+            at90can_send_message(TRACE_DUMP | SUCCESSFULL_RESPONSE, 4);
+
+            index = (index + 1) % TRACE_SIZE;
+            message_data_counter = (message_data_counter & ~START_OF_MESSAGE_MASK) - 1;
+        } while (--trace_count);
+    }
+
+    trace_position = 0;
+    trace_stopped = false;
+}
+
+#endif
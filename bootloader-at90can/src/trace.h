@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2010, 2015-2017 Fabian Greif.
+ * All rights reserved.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+/**
+ * \file
+ * \brief   Event trace for debugging
+ *
+ * Events are recorded with a timestamp of the CAN timer (100 us) in a ring
+ * buffer, the oldest ones are overwritten. TRACE_DUMP without data stops
+ * the recording and returns the number of entries, TRACE_DUMP with
+ * data[0] = 1 sends every entry as one message:
+ *
+ * - 0..1   timestamp (big endian)
+ * - 2..3   event (upper four bits) and argument (lower twelve bits)
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include <avr/io.h>
+
+#include "defaults.h"
+
+enum
+{
+    TRACE_RX        = 1,    //!< Frame received, argument is the command
+    TRACE_TX        = 2,    //!< Response queued, argument is the type
+    TRACE_ERASE     = 3,    //!< Page erase started, argument is the page
+    TRACE_WRITE     = 4,    //!< Page write started, argument is the page
+    TRACE_SPM_DONE  = 5,    //!< SPM operation finished
+    TRACE_STATE     = 6,    //!< State of main() changed
+};
+
+#if BOOT_TRACE
+
+/**
+ * Record an event.
+ *
+ * \param   time    timestamp, see TRACE()
+ * \param   event   see above
+ * \param   arg     argument of the event (twelve bits)
+ */
+void
+trace_event(uint16_t time, uint8_t event, uint16_t arg);
+
+/**
+ * Stop recording events.
+ *
+ * \return  number of recorded events
+ */
+uint8_t
+trace_stop(void);
+
+/**
+ * Send all recorded events, oldest first, clear the buffer and start
+ * recording again.
+ *
+ * The events are sent as one block of messages with the current message
+ * header. An empty buffer is reported with a single empty message.
+ */
+void
+trace_dump(void);
+
+#define TRACE(event, arg)           trace_event(CANTIM, (event), (arg))
+#define TRACE_AT(time, event, arg)  trace_event((time), (event), (arg))
+
+#else
+
+#define TRACE(event, arg)
+#define TRACE_AT(time, event, arg)
+
+#endif
+
+#endif // TRACE_H
@@ -11,6 +11,10 @@
 
 #define BOOTLOADER_TYPE     0
 
+//#define   BOOT_STREAMING_FILL 1
+
+//#define   BOOT_STATS          1
+
 #define BOOT_LED            B,1
 
 //#define   BOOT_INIT
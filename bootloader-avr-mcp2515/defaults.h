@@ -62,6 +62,18 @@
     #define BOOTLOADER_TYPE     0
 #endif
 
+// Fill the temporary page buffer of the SPM unit directly with the
+// received data instead of collecting a page in SRAM first
+#ifndef BOOT_STREAMING_FILL
+    #define BOOT_STREAMING_FILL     0
+#endif
+
+// Count received frames, errors and written pages, see stats.h. The
+// counters are read with the STATS command.
+#ifndef BOOT_STATS
+    #define BOOT_STATS              0
+#endif
+
 // Set current version of the bootloader
 
 #define BOOTLOADER_VERSION      2
@@ -31,13 +31,45 @@
 #include "defaults.h"
 #include "mcp2515.h"
 #include "mcp2515_defs.h"
+#include "stats.h"
 
 // ----------------------------------------------------------------------------
 // global variables
 
+// Flags reported in the third byte of the page ACK
+#define WRITE_SKIPPED       0x01
+#define ERASE_SKIPPED       0x02
+
 static uint16_t flashpage = 0;
 static uint8_t page_buffer_pos = 0;
+#if BOOT_STREAMING_FILL
+// The current page is erased, the temporary page buffer can be filled
+static uint8_t page_erased = 0;
+#else
 static uint8_t page_buffer[SPM_PAGESIZE];
+#endif
+
+#if BOOT_STATS
+stats_t stats;
+
+/**
+ * \brief   wait for the SPM unit and add the time to stats.spm_time
+ *
+ * Timer 1 is free after the boot window has been stopped.
+ */
+static void
+boot_spm_wait(void)
+{
+    TCNT1 = 0;
+    TCCR1B = TIMER_PRESCALER;
+    boot_spm_busy_wait();
+    TCCR1B = 0;
+
+    stats.spm_time += TCNT1;
+}
+#else
+    #define boot_spm_wait()     boot_spm_busy_wait()
+#endif
 
 /**
  * \brief   starts the application program
@@ -72,21 +104,61 @@ boot_jump_to_application(void)
     // application.
 }
 
+#if BOOT_STREAMING_FILL
+/**
+ * \brief   erase a page and discard the temporary page buffer
+ *
+ * \param   page    page which should be erased
+ *
+ * \see     avr-libc Documentation > Modules > Bootloader Support Utilities
+ */
+void
+boot_erase_page(uint16_t page)
+{
+    // Writing RWWSRE also clears the temporary page buffer
+    boot_rww_enable();
+
+    boot_page_erase((uint32_t) page * SPM_PAGESIZE);
+    boot_spm_wait();            // Wait until the memory is erased.
+
+    boot_rww_enable();
+}
+
+#else
 /**
  * \brief   write a complete page to the flash memorey
  *
+ * The page is not written if the flash already contains the same data
+ * and the erase is skipped if the page is blank.
+ *
  * \param   page    page which should be written
  * \param   *buf    Pointer to the buffer with the data
+ * \return  WRITE_SKIPPED and/or ERASE_SKIPPED
  *
  * \see     avr-libc Documentation > Modules > Bootloader Support Utilities
  */
-void
+uint8_t
 boot_program_page(uint16_t page, uint8_t *buf)
 {
-    uint32_t adr = page * SPM_PAGESIZE;
+    uint32_t adr = (uint32_t) page * SPM_PAGESIZE;
 
-    boot_page_erase(adr);
-    boot_spm_busy_wait();     // Wait until the memory is erased.
+    uint8_t status = WRITE_SKIPPED | ERASE_SKIPPED;
+    for (uint16_t i=0; i < SPM_PAGESIZE; i++)
+    {
+        uint8_t value = pgm_read_byte((uint16_t) adr + i);
+        if (value != buf[i])
+            status &= ~WRITE_SKIPPED;
+        if (value != 0xff)
+            status &= ~ERASE_SKIPPED;
+    }
+
+    if (status & WRITE_SKIPPED)
+        return WRITE_SKIPPED | ERASE_SKIPPED;
+
+    if (!(status & ERASE_SKIPPED)) {
+        boot_page_erase(adr);
+        boot_spm_wait();          // Wait until the memory is erased.
+    }
 
     for (uint16_t i=0; i < SPM_PAGESIZE; i+=2)
     {
@@ -98,12 +170,15 @@ boot_program_page(uint16_t page, uint8_t *buf)
     }
 
     boot_page_write(adr);       // Store buffer in flash page.
-    boot_spm_busy_wait();       // Wait until the memory is written.
+    boot_spm_wait();            // Wait until the memory is written.
 
     // Reenable RWW-section again. We need this if we want to jump back
     // to the application after bootloading.
     boot_rww_enable();
+
+    return status;
 }
+#endif
 
 void
 boot(void) __attribute__((section(".vectors"), naked, used));
@@ -187,6 +262,14 @@ main(void)
         // wait until we receive a new message
         while ((command = mcp2515_get_message()) == NO_MESSAGE)
         {
+#if BOOT_STATS
+            // both receive buffers were full when a frame arrived
+            if (mcp2515_read_register(EFLG) & ((1 << RX1OVR) | (1 << RX0OVR)))
+            {
+                stats.rx_overruns++;
+                mcp2515_write_register(EFLG, 0);
+            }
+#endif
             if (TIMER_INTERRUPT_FLAG_REGISTER & (1 << TOV1))
             {
                 BOOT_LED_OFF;
@@ -199,6 +282,8 @@ main(void)
         // stop timer
         TCCR1B = 0;
 
+        STATS_INC(frames_received);
+
         // check if the message is a request, otherwise reject it
         if ((command & ~COMMAND_MASK) != REQUEST) {
             continue;
@@ -213,6 +298,7 @@ main(void)
             // wrong message number => send NACK
             message_number = next_message_number;
             next_message_number--;
+            STATS_INC(sequence_errors);
             mcp2515_send_message(command | WRONG_NUMBER_REPSONSE, 0);
             continue;
         }
@@ -240,6 +326,17 @@ main(void)
                     message_data[2] < (SPM_PAGESIZE / 4) &&
                     page < RWW_PAGES)
             {
+#if BOOT_STREAMING_FILL
+                // A page is (re)started at position zero, any other
+                // position must continue the current page exactly.
+                if (message_data[3] == 0) {
+                    boot_erase_page(page);
+                    page_erased = 1;
+                }
+                else if (page != flashpage || message_data[3] != page_buffer_pos) {
+                    goto error_response;
+                }
+#endif
                 flashpage = page;
                 page_buffer_pos = message_data[3];
 
@@ -269,13 +366,32 @@ main(void)
             }
 
             if (message_data_counter != next_message_data_counter) {
+                STATS_INC(sequence_errors);
                 state = IDLE;
                 goto error_response;
             }
             next_message_data_counter--;
 
             // copy data
+#if BOOT_STREAMING_FILL
+            // The page is erased before its first data, pages behind the
+            // image stay untouched
+            if (!page_erased)
+            {
+                if (flashpage >= RWW_PAGES) {
+                    state = IDLE;
+                    goto error_response;
+                }
+                boot_erase_page(flashpage);
+                page_erased = 1;
+            }
+
+            uint32_t adr = (uint32_t) flashpage * SPM_PAGESIZE + page_buffer_pos * 4;
+            boot_page_fill(adr, message_data[0] | (message_data[1] << 8));
+            boot_page_fill(adr + 2, message_data[2] | (message_data[3] << 8));
+#else
             memcpy(page_buffer + page_buffer_pos * 4, message_data, 4);
+#endif
             page_buffer_pos++;
 
             if (message_data_counter == 0)
@@ -290,12 +406,29 @@ main(void)
                         goto error_response;
                     }
 
-                    boot_program_page(flashpage, page_buffer);
+#if BOOT_STREAMING_FILL
+                    message_data[2] = 0;
+                    boot_page_write((uint32_t) flashpage * SPM_PAGESIZE);
+                    boot_spm_wait();
+                    boot_rww_enable();
+                    STATS_INC(pages_written);
+                    page_erased = 0;
+#else
+                    message_data[2] = boot_program_page(flashpage, page_buffer);
+#if BOOT_STATS
+                    if (message_data[2] & WRITE_SKIPPED) {
+                        stats.pages_skipped++;
+                    }
+                    else {
+                        stats.pages_written++;
+                    }
+#endif
+#endif
                     page_buffer_pos = 0;
                     flashpage += 1;
 
                     // send ACK
-                    mcp2515_send_message(DATA | SUCCESSFULL_RESPONSE, 2);
+                    mcp2515_send_message(DATA | SUCCESSFULL_RESPONSE, 3);
                 }
                 else {
                     mcp2515_send_message(DATA | SUCCESSFULL_RESPONSE, 0);
@@ -329,12 +462,37 @@ main(void)
             for (uint32_t i = 0; i < RWW_PAGES; i++ )
             {
                 boot_page_erase(i * SPM_PAGESIZE);
-                boot_spm_busy_wait();
+                boot_spm_wait();
             }
             boot_rww_enable();
 
             mcp2515_send_message(CHIP_ERASE | SUCCESSFULL_RESPONSE, 0);
         }
+#endif
+#if BOOT_STATS
+        else if (command == STATS)
+        {
+            // the counters as big endian values in a block of four
+            // messages, the SPM time is converted to 100 us
+            uint16_t values[8];
+            memcpy(values, &stats, 6 * sizeof(uint16_t));
+
+            uint32_t time = (stats.spm_time * 1024) / (F_CPU / 10000);
+            values[6] = HIGH_WORD(time);
+            values[7] = LOW_WORD(time);
+
+            message_data_counter = START_OF_MESSAGE_MASK | 3;
+            for (uint8_t i = 0; i < 8; i += 2)
+            {
+                message_data[0] = HIGH_BYTE(values[i]);
+                message_data[1] = LOW_BYTE(values[i]);
+                message_data[2] = HIGH_BYTE(values[i + 1]);
+                message_data[3] = LOW_BYTE(values[i + 1]);
+                mcp2515_send_message(STATS | SUCCESSFULL_RESPONSE, 4);
+
+                message_data_counter = (message_data_counter & ~START_OF_MESSAGE_MASK) - 1;
+            }
+        }
 #endif
         else
         {
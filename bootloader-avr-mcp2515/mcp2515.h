@@ -31,6 +31,9 @@ typedef enum {
     GET_FUSEBITS    = 5,
     CHIP_ERASE      = 6,
 
+    // only available with BOOT_STATS
+    STATS           = 24,
+
     REQUEST                 = 0x00,
     SUCCESSFULL_RESPONSE    = 0x40,
     ERROR_RESPONSE          = 0x80,
@@ -46,6 +49,12 @@ typedef enum {
 void
 mcp2515_send_message(uint8_t type, uint8_t length);
 
+void
+mcp2515_write_register(uint8_t adress, uint8_t data);
+
+uint8_t
+mcp2515_read_register(uint8_t adress);
+
 uint8_t
 mcp2515_get_message(void);
 
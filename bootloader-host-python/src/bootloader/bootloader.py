@@ -20,11 +20,19 @@ Format:
 4. Message Data Counter
 5.-8. Data
 
+29-Bit Identifier (only DATA requests and responses with more than four
+bytes of data, if supported by the bootloader)
+
+Bits 28..24: Prefix (0x1f requests, 0x1e responses)
+Bits 23..16: Board Identifier
+Bits 15..8:  Message Number (requests) or Message Type (responses)
+Bits 7..0:   Message Data Counter
+1.-8. Data
+
 """
 
 import sys
 import time
-import math
 import queue
 import threading
 import functools
@@ -32,6 +40,9 @@ import functools
 from . import can
 from . import message_filter as filter
 
+from .util import crc
+from .util import intelhex
+from .util import lz
 from .util import progressbar
 
 version = "1.5"
@@ -39,18 +50,33 @@ version = "1.5"
 
 class BootloaderFilter(filter.BaseFilter):
 
+    def __init__(self, callback, identifiers = (0x7fe,)):
+        """
+        identifiers -- standard identifiers of the responses, the common
+                       identifier and the one of the board
+        """
+        filter.BaseFilter.__init__(self, callback)
+        self.identifiers = identifiers
+
     def check(self, message):
-        if  message.extended == False and \
-            message.rtr == False and \
-            message.id == 0x7fe:
-            return True
-        return False
+        if message.rtr:
+            return False
+        if message.extended:
+            return (message.id >> 24) == Message.EXTENDED_PREFIX_RESPONSE
+        return message.id in self.identifiers
 
 
 class BootloaderException(Exception):
     pass
 
 
+class ErrorResponse(BootloaderException):
+    """The bootloader answered a request with an error"""
+    def __init__(self, text, response):
+        BootloaderException.__init__(self, text)
+        self.response = response
+
+
 class MessageSubject:
     # only available in type >= 2
     NO_OPERATION    = 0
@@ -72,6 +98,52 @@ class MessageSubject:
     SET_BOARD_ID    = 10
     SET_BITRATE     = 11
 
+    # only available in the extended types (>= 1)
+    FLASH_CRC       = 12
+
+    # only available with BOOT_COMPRESSED_DATA
+    COMPRESSED_DATA = 13
+
+    # only available with BOOT_MULTICAST
+    JOIN_GROUP      = 14
+    GROUP_STATUS    = 15
+
+    # only available in the extended types (>= 1)
+    READ_FLASH_RANGE = 16
+    SET_EEPROM_ADDRESS = 17
+    EEPROM_DATA     = 18
+    READ_EEPROM_RANGE = 19
+
+    # only available in type >= 2
+    SET_BOOT_WINDOW = 20
+
+    # only available with BOOT_DATA_OFFSET
+    DATA_OFFSET     = 21
+
+    # only available in type >= 2 with BOOT_BOARD_IDENTIFIERS
+    SET_IDENTIFIERS = 22
+
+    # only available in the extended types (>= 1)
+    ERASE_RANGE     = 23
+
+    # only available with BOOT_STATS
+    STATS           = 24
+
+    # only available with BOOT_TRACE
+    TRACE_DUMP      = 25
+
+    # only available in type >= 2 with BOOT_SESSION_BITRATE
+    SESSION_BITRATE = 26
+
+    # only available with BOOT_ACK_INTERVAL
+    SET_ACK_INTERVAL = 27
+
+    # only available with BOOT_PATCH_PAGE
+    PATCH_PAGE      = 28
+
+    # only available in the extended types (>= 1) with BOOT_STAGING
+    COMMIT_STAGED   = 29
+
     # independent from bootloader
     START_BOOTLOADER = 127
 
@@ -91,6 +163,24 @@ class MessageSubject:
                  9: "write_eeprom",
                  10: "set_board_id",
                  11: "set_bitrate",
+                 12: "flash_crc",
+                 13: "compressed_data",
+                 14: "join_group",
+                 15: "group_status",
+                 16: "read_flash_range",
+                 17: "set_eeprom_address",
+                 18: "eeprom_data",
+                 19: "read_eeprom_range",
+                 20: "set_boot_window",
+                 21: "data_offset",
+                 22: "set_identifiers",
+                 23: "erase_range",
+                 24: "stats",
+                 25: "trace_dump",
+                 26: "session_bitrate",
+                 27: "set_ack_interval",
+                 28: "patch_page",
+                 29: "commit_staged",
                  127: "start_bootloader"}[self.subject]
 
 
@@ -114,17 +204,27 @@ class Message:
     """ Representation of a message for the bootloader """
 
     BOOTLOADER_CAN_IDENTIFIER = 0x7ff
+    BOOTLOADER_CAN_RESPONSE_IDENTIFIER = 0x7fe
     START_OF_MESSAGE_MASK = 0x80
 
+    # boards with BOOT_BOARD_IDENTIFIERS derive their identifiers from the
+    # board id if none are stored (see board_identifiers())
+    BOARD_IDENTIFIER_BASE = 0x500
+
+    EXTENDED_PREFIX_REQUEST = 0x1f
+    EXTENDED_PREFIX_RESPONSE = 0x1e
+
     def __init__(   self,
                     board_id = None,
                     messageType = MessageType.REQUEST,
                     subject = None,
                     number = 0,
                     data_counter = 0,
-                    data = []):
+                    data = [],
+                    identifier = None):
 
         # set default values
+        self.identifier = identifier
         self.board_id = board_id
         self.type = messageType
         self.subject = subject
@@ -134,6 +234,19 @@ class Message:
 
     def decode(self, message):
 
+        if message.extended and not message.rtr and \
+                (message.id >> 24) == self.EXTENDED_PREFIX_RESPONSE:
+            # the header is part of the identifier, the message number is
+            # not transmitted
+            self.board_id = (message.id >> 16) & 0xff
+            self.type = (message.id >> 14) & 0x03
+            self.subject = (message.id >> 8) & 0x3f
+            self.number = None
+            self.data_counter = message.id & 0xff
+            self.data = message.data
+
+            return self
+
         if len(message.data) < 4 or message.extended or message.rtr:
             raise BootloaderException("wrong format of message %s" % message)
 
@@ -148,21 +261,48 @@ class Message:
         return self
 
     def encode(self):
-        """ Convert the bootloader-message to a can-message """
+        """ Convert the bootloader-message to a can-message
+
+        DATA messages with more than four bytes are sent with an extended
+        identifier.
+        """
+        if len(self.data) > 4:
+            if self.subject != MessageSubject.DATA or self.type != MessageType.REQUEST:
+                raise BootloaderException("only DATA requests can carry more than four bytes")
+
+            identifier = self.EXTENDED_PREFIX_REQUEST << 24 | self.board_id << 16 | \
+                         self.number << 8 | self.data_counter
+            return can.Message(identifier, list(self.data), extended = True, rtr = False)
+
+        identifier = self.identifier
+        if identifier is None:
+            identifier = self.BOOTLOADER_CAN_IDENTIFIER
 
         data = [self.board_id, self.type << 6 | self.subject, self.number, self.data_counter] + self.data
-        message = can.Message(self.BOOTLOADER_CAN_IDENTIFIER, data, extended = False, rtr = False)
+        message = can.Message(identifier, data, extended = False, rtr = False)
 
         return message
 
     def __str__(self):
-        s = "%s.%s id 0x%x [%x] %i >" % (MessageSubject(self.subject).__str__().upper(), MessageType(self.type), self.board_id, self.number, self.data_counter)
+        number = "-" if self.number is None else "%x" % self.number
+        s = "%s.%s id 0x%x [%s] %i >" % (MessageSubject(self.subject).__str__().upper(), MessageType(self.type), self.board_id, number, self.data_counter)
         for data in self.data:
             s += " %02x" % data
 
         return s
 
 
+def board_identifiers(board_id):
+    """
+    Request and response identifier derived from the board id
+
+    Used by boards with BOOT_BOARD_IDENTIFIERS until other identifiers
+    are stored with set_identifiers().
+    """
+    request = Message.BOARD_IDENTIFIER_BASE + 2 * board_id
+    return (request, request + 1)
+
+
 class ProgrammeableBoard:
     """Container class which holds information about an active board"""
 
@@ -175,6 +315,17 @@ class ProgrammeableBoard:
         self.version = 0.0
         self.pages = 0
         self.pagesize = 0
+        self.extended_data = False
+        self.compressed_data = False
+        self.multicast = False
+        self.fast_start = False
+        self.data_offset = False
+
+        # receive MObs of the bootloader for the identifier used
+        self.receive_buffers = 8
+
+        # ERASE_RANGE support, None until the first request
+        self.erase_range = None
 
     def __str__(self):
         s = "board id %d (0x%x)" % (self.id, self.id)
@@ -191,13 +342,48 @@ class Bootloader:
     END = 3
     ERROR = 4
 
-    def __init__(self, board_id, interface, debug = False):
-        """Constructor"""
+    # optional features reported by the IDENTIFY command
+    FEATURE_EXTENDED_DATA = 0x80
+    FEATURE_COMPRESSED_DATA = 0x40
+    FEATURE_MULTICAST = 0x20
+    FEATURE_FAST_START = 0x10
+    FEATURE_DATA_OFFSET = 0x08
+
+    # data counter flag of DATA_OFFSET requesting a response
+    DATA_OFFSET_RESPOND = 0x80
+
+    # application descriptor in the last eight bytes of the flash
+    DESCRIPTOR_MAGIC = 0x5aa5
+    DESCRIPTOR_SIZE = 8
+
+    # flags of the DATA acknowledge (third byte)
+    WRITE_SKIPPED = 0x01
+    ERASE_SKIPPED = 0x02
+
+    # bitrates of the bootloader indexed by the bitrates of the CAN
+    # interface (0..8), 800 kbit/s is not available
+    SESSION_BITRATES = {0: 0, 1: 1, 2: 2, 3: 3, 4: 4, 5: 5, 6: 6, 8: 7}
+
+    # the bootloader restores the previous bitrate if no message is
+    # received within this time
+    SESSION_BITRATE_TIMEOUT = 0.5
+
+    def __init__(self, board_id, interface, debug = False, identifiers = None):
+        """
+        Constructor
+
+        identifiers -- (request, response) identifiers of boards with
+                       BOOT_BOARD_IDENTIFIERS, None to use the common ones
+        """
 
         self.board = ProgrammeableBoard(board_id)
+        self.identifiers = identifiers
 
         # connect to the message dispatcher
-        bootfilter = BootloaderFilter(self._get_message)
+        responses = (Message.BOOTLOADER_CAN_RESPONSE_IDENTIFIER,)
+        if identifiers is not None:
+            responses += (identifiers[1],)
+        bootfilter = BootloaderFilter(self._get_message, responses)
         self.interface = interface
         self.interface.addFilter(bootfilter)
 
@@ -294,17 +480,42 @@ class Bootloader:
         board.bootloader_type = response.data[0] >> 4
         board.version = response.data[0] & 0x0F
 
-        board.pagesize = {0: 32, 1: 64, 2: 128, 3: 256}[response.data[1]]
+        # the upper bits of the pagesize identifier report optional features
+        board.pagesize = {0: 32, 1: 64, 2: 128, 3: 256}[response.data[1] & 0x03]
+        board.extended_data = (response.data[1] & self.FEATURE_EXTENDED_DATA) != 0
+        board.compressed_data = (response.data[1] & self.FEATURE_COMPRESSED_DATA) != 0
+        board.multicast = (response.data[1] & self.FEATURE_MULTICAST) != 0
+        board.fast_start = (response.data[1] & self.FEATURE_FAST_START) != 0
+        board.data_offset = (response.data[1] & self.FEATURE_DATA_OFFSET) != 0
         board.pages = (response.data[2] << 8) + response.data[3]
 
+        # the data counter reports the number of receive MObs, older
+        # bootloaders use eight
+        receive_buffers = response.data_counter & ~Message.START_OF_MESSAGE_MASK
+        board.receive_buffers = receive_buffers if receive_buffers else 8
+
     def program_page(self, page, data, addressAlreadySet = False):
         """
         Program a page of the flash memory
 
-        Tries the send the data in a blocks of 32 messages befor an
+        Returns the flags WRITE_SKIPPED and ERASE_SKIPPED reported by the
+        bootloader (zero for older bootloaders).
+
+        Tries the send the data in a blocks of 64 messages befor an
         acknowledge. The blocksize is stepwise reduced to one when there
         are any errors during the transmission.
         Raises BootloaderException if the error stil appears then.
+
+        After an error the page is restarted from the beginning. Bootloaders
+        which fill the temporary page buffer of the SPM unit directly can
+        only accept a page in order.
+
+        If the bootloader supports extended DATA frames every message
+        carries eight instead of four bytes.
+
+        If the bootloader supports compressed data the page is sent
+        compressed with COMPRESSED_DATA messages, unless the compression
+        doesn't make it smaller.
         """
         data = [ord(x) for x in data]
 
@@ -313,43 +524,52 @@ class Bootloader:
         if size < self.board.pagesize:
             data += [0xff] * (self.board.pagesize - size)
 
-        remaining = self.board.pagesize / 4
+        # number of bytes per message
+        size = 8 if self.board.extended_data else 4
+
+        subject, chunks = self._page_chunks(data, size, self.board.compressed_data)
+
+        if subject == MessageSubject.DATA and self.board.data_offset:
+            return self._program_page_selective(page, data)
+
+        remaining = len(chunks)
         blocksize = 64
         offset = 0
 
         while remaining > 0:
             try:
                 if not addressAlreadySet:
-                    # set address in the page buffer
-                    self._send( subject=MessageSubject.SET_ADDRESS, data=[page >> 8, page & 0xff, 0, offset] )
+                    # set address in the page buffer (in units of four bytes)
+                    position = offset * size // 4
+                    self._send( subject=MessageSubject.SET_ADDRESS, data=[page >> 8, page & 0xff, 0, position] )
 
                 if remaining < blocksize:
                     blocksize = remaining
 
                 if blocksize == 1:
-                    answer = self._send( subject=MessageSubject.DATA, data=data[offset*4:offset*4 + 4] )
+                    answer = self._send( subject=subject, data=chunks[offset] )
                 else:
                     i = offset
 
                     # start of a new block
-                    self._send( subject=MessageSubject.DATA,
+                    self._send( subject=subject,
                                 response=False,
                                 counter=Message.START_OF_MESSAGE_MASK | (blocksize - 1),
-                                data=data[i * 4: i * 4 + 4])
+                                data=chunks[i])
 
                     for k in range(blocksize - 2, 0 , -1):
                         i += 1
-                        self._send( subject=MessageSubject.DATA,
+                        self._send( subject=subject,
                                     response=False,
                                     counter=k,
-                                    data=data[i*4:i*4 + 4] )
+                                    data=chunks[i] )
 
                     # wait for the response for the last message of this block
                     i += 1
-                    answer = self._send( subject=MessageSubject.DATA,
+                    answer = self._send( subject=subject,
                                 response=True,
                                 counter=0,
-                                data=data[i * 4: i * 4 + 4])
+                                data=chunks[i])
 
                 remaining -= blocksize
                 offset += blocksize
@@ -359,11 +579,13 @@ class Bootloader:
             except BootloaderException as msg:
                 print("Exception: %s" % msg)
                 if blocksize > 1:
-                    blocksize /= 2
+                    blocksize //= 2
                     print(blocksize)
 
                     # we have to reset the buffer position
                     addressAlreadySet = False
+                    remaining = len(chunks)
+                    offset = 0
 
                     time.sleep(0.3)
                 else:
@@ -378,6 +600,116 @@ class Bootloader:
         # page was completly transmitted => write it to the flash
         #self._send( MessageSubject.WRITE_PAGE, [page / 0xff, page % 0xff] )
 
+        # newer bootloaders report whether the erase or write was skipped
+        if len(answer.data) > 2:
+            return answer.data[2]
+        return 0
+
+    def _program_page_selective(self, page, data):
+        """
+        Program a page with DATA_OFFSET messages
+
+        Every message carries the slot of its four bytes within the page
+        and the low byte of the page instead of the message number. Only the
+        last message is answered, with the ACK of the written page or with
+        the slots which are still missing. These are sent again.
+        """
+        self._send(subject=MessageSubject.SET_ADDRESS, data=[page >> 8, page & 0xff, 0, 0])
+
+        chunks = [data[i:i + 4] for i in range(0, len(data), 4)]
+        missing = list(range(len(chunks)))
+
+        for attempt in range(10):
+            for k, slot in enumerate(missing):
+                last = (k == len(missing) - 1)
+                counter = slot | (self.DATA_OFFSET_RESPOND if last else 0)
+                answer = self._send(subject=MessageSubject.DATA_OFFSET,
+                                    data=chunks[slot],
+                                    counter=counter,
+                                    response=last,
+                                    numbered=False,
+                                    number=page & 0xff)
+
+            if answer.number != page & 0xff:
+                raise BootloaderException("Could not write page %i!" % page)
+
+            if len(answer.data) == 3:
+                returned_page = answer.data[0] << 8 | answer.data[1]
+                if returned_page != page:
+                    raise BootloaderException("Could not write page %i!" % page)
+                return answer.data[2]
+
+            # first missing slot and a bitmap of the following ones
+            first = answer.data[0]
+            bitmap = answer.data[1] | answer.data[2] << 8 | answer.data[3] << 16
+            missing = [first + i for i in range(24)
+                            if bitmap & (1 << i) and first + i < len(chunks)]
+            if not missing:
+                missing = [first]
+            self.debug("Page %i: resend slots %s" % (page, missing))
+
+        raise BootloaderException("Could not write page %i!" % page)
+
+    def _page_chunks(self, data, size, compressed):
+        """
+        Split a page (list of bytes) into the payload of the messages
+
+        Returns the subject of the messages and the list of payloads.
+        If compression is enabled the page is sent compressed unless that
+        doesn't make it smaller.
+        """
+        if compressed:
+            stream = lz.compress(data)
+            if len(stream) < len(data):
+                # the last message may be shorter than four bytes
+                return (MessageSubject.COMPRESSED_DATA,
+                        [stream[i:i + 4] for i in range(0, len(stream), 4)])
+
+        return (MessageSubject.DATA,
+                [data[i:i + size] for i in range(0, len(data), size)])
+
+    def _split_pages(self, segments):
+        """
+        Build a map of the pages from the addresses of the segments
+
+        Returns a dictionary page -> data of the page, sorted by the page.
+        Parts of a page not covered by any segment are filled with 0xff,
+        pages without any data are not part of the map.
+        """
+        pagesize = self.board.pagesize
+
+        pages = {}
+        for segment in segments:
+            for offset, value in enumerate(segment.data):
+                address = segment.address + offset
+                page = pages.setdefault(address // pagesize, ['\xff'] * pagesize)
+                page[address % pagesize] = value
+
+        return dict((page, "".join(pages[page])) for page in sorted(pages))
+
+    def _fill_gaps(self, page_map):
+        """
+        Add blank pages for the gaps between the pages of the map
+
+        Required if the application descriptor is written, the CRC covers
+        the gaps too.
+        """
+        if not page_map:
+            return page_map
+        blank = '\xff' * self.board.pagesize
+        return dict((page, page_map.get(page, blank)) for page in range(max(page_map) + 1))
+
+    def _is_blank(self, data):
+        return all(x == '\xff' for x in data)
+
+    def _pad_page(self, data):
+        """Convert the data of a page to a list of bytes and fill it up with 0xff"""
+        data = [ord(x) for x in data]
+        return data + [0xff] * (self.board.pagesize - len(data))
+
+    def _page_crc(self, data):
+        return crc.crc_ccitt(self._pad_page(data))
+
     def verify_page(self, page, data):
         """
         Verify a page of the flash memory
@@ -389,7 +721,7 @@ class Bootloader:
         if size < self.board.pagesize:
             data += [0xff] * (self.board.pagesize - size)
 
-        remaining = self.board.pagesize / 4
+        remaining = self.board.pagesize // 4
         offset = 0
 
         while remaining > 0:
@@ -403,16 +735,252 @@ class Bootloader:
             remaining -= 1
             offset += 1
 
+    def read_flash(self, pages = None):
+        """
+        Read the flash memory
+
+        pages -- range of the pages to read, default is the whole
+                 application section
+
+        Returns the content as a list of bytes.
+        """
+        if pages is None:
+            pages = range(self.board.pages)
+
+        size = 8 if self.board.extended_data else 4
+
+        # a block is limited to 128 messages by the data counter
+        burst = max(1, 128 * size // self.board.pagesize)
+
+        data = []
+        page = pages.start
+        self._report_progress(self.START)
+        while page < pages.stop:
+            count = min(burst, pages.stop - page)
+            frames = count * self.board.pagesize // size
+
+            answers = self._send(subject=MessageSubject.READ_FLASH_RANGE,
+                                 data=[page >> 8, page & 0xff, count >> 8, count & 0xff],
+                                 frames=frames)
+            if frames == 1:
+                answers = [answers]
+
+            # frames with the same identifier might be reordered by the
+            # CAN controller, sort them by their data counter
+            block = [None] * frames
+            for answer in answers:
+                index = frames - 1 - (answer.data_counter & ~Message.START_OF_MESSAGE_MASK)
+                if 0 <= index < frames:
+                    block[index] = answer.data
+            if None in block:
+                raise BootloaderException("Incomplete data while reading page %i!" % page)
+
+            for b in block:
+                data.extend(b)
+
+            page += count
+            self._report_progress(self.IN_PROGRESS,
+                                  float(page - pages.start) / float(len(pages)))
+
+        self._report_progress(self.END)
+        return data
+
+    def save_flash(self, filename, pages = None):
+        """
+        Read the flash memory and store it in a file
+
+        Files ending with '.hex' are written in the Intel HEX format,
+        all others as raw binary.
+        """
+        self.identify()
+        if self.board.bootloader_type == 0:
+            raise BootloaderException("Reading the flash requires an extended Bootloader. Aborting!")
+
+        if pages is None:
+            pages = range(self.board.pages)
+
+        print("Read %i pages:" % len(pages))
+        starttime = time.time()
+
+        data = self.read_flash(pages)
+
+        totaltime = time.time() - starttime
+        print("%.2f seconds (%i Byte/s)\n" % (totaltime, int(len(data) / totaltime)))
+
+        address = pages.start * self.board.pagesize
+        if filename.lower().endswith(".hex"):
+            intelhex.write_hex_file(filename, address, data)
+        else:
+            with open(filename, "wb") as f:
+                f.write(bytes(data))
+
+    def write_eeprom(self, address, data):
+        """
+        Write a list of bytes to the EEPROM
+
+        The bootloader only writes cells with a different content. Blocks
+        are limited to the receive MObs of the bootloader, it can't
+        receive more while it is waiting for the EEPROM.
+        """
+        chunks = [data[i:i + 4] for i in range(0, len(data), 4)]
+        offset = 0
+        errors = 0
+
+        self._send(subject=MessageSubject.SET_EEPROM_ADDRESS,
+                   data=[address >> 8, address & 0xff])
+
+        self._report_progress(self.START)
+        while offset < len(chunks):
+            block = chunks[offset:offset + self.board.receive_buffers]
+            try:
+                for k, chunk in enumerate(block):
+                    counter = len(block) - 1 - k
+                    if k == 0:
+                        counter |= Message.START_OF_MESSAGE_MASK
+
+                    self._send(subject=MessageSubject.EEPROM_DATA,
+                               data=chunk,
+                               counter=counter,
+                               response=(k == len(block) - 1))
+            except BootloaderException as msg:
+                print("Exception: %s" % msg)
+                errors += 1
+                if errors > 3:
+                    raise
+
+                # restart the block
+                position = address + offset * 4
+                self._send(subject=MessageSubject.SET_EEPROM_ADDRESS,
+                           data=[position >> 8, position & 0xff])
+                time.sleep(0.3)
+            else:
+                offset += len(block)
+                self._report_progress(self.IN_PROGRESS, float(offset) / float(len(chunks)))
+
+        self._report_progress(self.END)
+
+    def read_eeprom(self, address, length):
+        """Read a range of the EEPROM, returns a list of bytes"""
+        size = 8 if self.board.extended_data else 4
+        burst = 128 * size
+
+        data = []
+        end = address + length
+        while address < end:
+            count = min(burst, end - address)
+            frames = (count + size - 1) // size
+
+            answers = self._send(subject=MessageSubject.READ_EEPROM_RANGE,
+                                 data=[address >> 8, address & 0xff, count >> 8, count & 0xff],
+                                 frames=frames)
+            if frames == 1:
+                answers = [answers]
+
+            # sort the frames by their data counter, see read_flash()
+            block = [None] * frames
+            for answer in answers:
+                index = frames - 1 - (answer.data_counter & ~Message.START_OF_MESSAGE_MASK)
+                if 0 <= index < frames:
+                    block[index] = answer.data
+            if None in block:
+                raise BootloaderException("Incomplete data while reading EEPROM at 0x%04x!" % address)
+
+            for b in block:
+                data.extend(b)
+            address += count
+
+        return data
+
+    def program_eeprom(self, segments):
+        """Write the segments of an EEPROM image (.eep file)"""
+        self.identify()
+        if self.board.bootloader_type == 0:
+            raise BootloaderException("EEPROM access requires an extended Bootloader. Aborting!")
+
+        totalsize = functools.reduce(lambda x,y: x + y, map(lambda x: len(x), segments))
+        print("Program EEPROM (%i Bytes):" % totalsize)
+        starttime = time.time()
+
+        for segment in segments:
+            self.write_eeprom(segment.address, [ord(x) for x in segment.data])
+
+        totaltime = time.time() - starttime
+        print("%.2f seconds\n" % totaltime)
+
+    def verify_eeprom(self, segments):
+        """Compare the EEPROM with the segments of an EEPROM image"""
+        print("Verify EEPROM")
+        for segment in segments:
+            data = self.read_eeprom(segment.address, len(segment))
+            expected = [ord(x) for x in segment.data]
+            if data != expected:
+                failed = [segment.address + i for i in range(len(data)) if data[i] != expected[i]]
+                raise BootloaderException("Verify failed for EEPROM address(es) %s!" %
+                                          ", ".join("0x%04x" % i for i in failed[:16]))
+        print("ok\n")
+
+    def flash_crc(self, page, count = 1):
+        """
+        Calculate the CRC of a range of pages on the device
+
+        Returns the CRC-16 (CCITT, start value 0xffff) of the pages.
+        """
+        # the bootloader needs a few milliseconds per page
+        timeout = 0.5 + count * 0.005
+        answer = self._send(subject=MessageSubject.FLASH_CRC,
+                            data=[page >> 8, page & 0xff, count >> 8, count & 0xff],
+                            timeout=timeout)
+
+        return answer.data[0] << 8 | answer.data[1]
+
+    def join_group(self, group_id):
+        """
+        Join a programming group (see BootloaderGroup)
+
+        A group id of zero leaves the group. Resets the list of the
+        received pages.
+        """
+        self._send(subject=MessageSubject.JOIN_GROUP, data=[group_id])
+
+    def missing_pages(self, pages):
+        """Returns the pages below `pages` not written since joining the group"""
+        missing = []
+        page = 0
+        while page < pages:
+            answer = self._send(subject=MessageSubject.GROUP_STATUS,
+                                data=[page >> 8, page & 0xff])
+            page = answer.data[0] << 8 | answer.data[1]
+            if page < pages:
+                missing.append(page)
+                page += 1
+        return missing
+
     def start_app(self):
         """Start the written application"""
         self._send( MessageSubject.START_APPLICATION )
 
-    def program(self, segments):
+    def program(self, segments, erase = False, window = 1, base = None,
+                ignore_bootloader = False):
         """
         Program the AVR
 
         First the function waits for a connection then it will send the
         data page by page.
+
+        Only pages containing data of the segments are written, the
+        address is only set again after a gap. With `erase` the pages of
+        the image are erased first and pages containing only 0xff are
+        skipped.
+
+        With a `window` larger than one up to `window` pages are sent
+        without waiting for the acknowledge (requires BOOT_ACK_INTERVAL).
+
+        `base` are the segments of the image currently stored on the
+        device. Pages which differ only in a small part from it are
+        patched (requires BOOT_PATCH_PAGE), unchanged pages are skipped.
+
+        Images with data behind the application section are rejected, with
+        `ignore_bootloader` data in the boot section is skipped instead.
         """
         self._report_progress(self.WAITING)
 
@@ -425,86 +993,762 @@ class Bootloader:
         print("ok")
         print(self.board)
 
-        totalsize = functools.reduce(lambda x,y: x + y, map(lambda x: len(x), segments))
-        segment_number = 0
+        page_map = self._application_pages(segments, ignore_bootloader)
+        if self.board.fast_start:
+            # the CRC of the descriptor covers the gaps, they are erased
+            # or written with 0xff too
+            page_map = self._fill_gaps(page_map)
+
+        if erase:
+            print("erase flash")
+            for first, count in self._page_runs(page_map):
+                if not self.erase_range(first, count):
+                    self.chip_erase()
+                    break
+            page_map = dict((page, data) for page, data in page_map.items()
+                            if not self._is_blank(data))
+
+        patches = {}
+        if base is not None and not erase:
+            patches = self._find_patches(page_map, base)
 
         pagesize = self.board.pagesize
-        pages = int(math.ceil(float(totalsize) / float(pagesize)))
+        pages = len(page_map)
+        totalsize = pages * pagesize
 
-        print("write %i pages\n" % pages)
-        print("Program:")
+        if patches:
+            print("patch %i pages, %i unchanged" %
+                  (len([p for p in patches.values() if p[1]]),
+                   len([p for p in patches.values() if not p[1]])))
+            write_map = dict((page, data) for page, data in page_map.items()
+                             if page not in patches)
+        else:
+            write_map = page_map
 
-        if pages > self.board.pages:
-            raise BootloaderException("Programsize exceeds available Flash!")
+        window = self._check_window(window)
+
+        print("write %i pages\n" % len(write_map))
+        print("Program:")
 
         # start progressbar
         self._report_progress(self.START)
         starttime = time.time()
-        addressSet = False
-        offset = 0
+        skipped = self._write_pages(write_map, window, pages)
+
+        patch_supported = True
+        for page, (offset, length) in patches.items():
+            if length == 0:
+                skipped += 1
+                continue
 
-        for i in range(pages):
-            data = segments[segment_number]
-            self.program_page(page = i,
-                              data = data[offset:offset+pagesize],
-                              addressAlreadySet = addressSet)
-            offset += pagesize
-            if offset >= len(data):
-                offset = 0
-                segment_number += 1
-                self.debug("Now starting segment %i" % segment_number)
-            addressSet = True
-            self._report_progress(self.IN_PROGRESS, float(i) / float(pages))
+            if patch_supported:
+                try:
+                    status = self.patch_page(page, page_map[page], offset, length)
+                except BootloaderException as msg:
+                    print("Exception: %s" % msg)
+                    patch_supported = False
+            if not patch_supported:
+                status = self.program_page(page = page, data = page_map[page])
+            if status & self.WRITE_SKIPPED:
+                skipped += 1
 
         # show a 100% progressbar
         self._report_progress(self.END)
 
+        if self.board.fast_start:
+            self.write_descriptor(segments)
+
         endtime = time.time()
         totaltime = endtime - starttime
         transferrate = int(totalsize / totaltime)
-        print("%.2f seconds (%i Byte/s)\n" % (totaltime, transferrate))
+        print("%.2f seconds (%i Byte/s)" % (totaltime, transferrate))
+        print("%i of %i pages unchanged\n" % (skipped, pages))
+
+        try:
+            stats = self.stats()
+        except BootloaderException:
+            self.debug("Statistics not available")
+        else:
+            print("Statistics:")
+            for name in self.STATS_COUNTERS:
+                print("  %-16s: %i" % (name.replace("_", " "), stats[name]))
+            print("  %-16s: %.3f s\n" % ("spm time", stats["spm_time"]))
+
+    def _check_window(self, window):
+        """Returns the usable window, one if the bootloader doesn't support it"""
+        if window > 1 and (self.board.compressed_data or self.board.data_offset):
+            print("window not used, the pages are sent compressed or with offsets")
+            return 1
+        if window > 1:
+            try:
+                self._set_ack_interval(1)
+            except BootloaderException:
+                print("window not supported by the bootloader")
+                return 1
+        return window
 
-    def verify(self, segments):
+    def _write_pages(self, page_map, window, pages):
+        """
+        Write the pages of the map and report the progress
+
+        `pages` is the total number of pages of the progressbar. Returns
+        the number of pages which were unchanged.
+        """
+        skipped = 0
+
+        if window > 1:
+            done = 0
+            for first, count in self._page_runs(page_map):
+                run = [page_map[page] for page in range(first, first + count)]
+                skipped += self._program_window(first, run, window,
+                        lambda n: self._report_progress(self.IN_PROGRESS, float(done + n) / float(pages)))
+                done += count
+        else:
+            previous = None
+            for i, (page, data) in enumerate(page_map.items()):
+                if previous is not None and page != previous + 1:
+                    self.debug("Continue with page %i" % page)
+
+                # the bootloader continues with the next page after a page
+                # was written
+                status = self.program_page(page = page,
+                                           data = data,
+                                           addressAlreadySet = (previous == page - 1))
+                if status & self.WRITE_SKIPPED:
+                    skipped += 1
+                previous = page
+                self._report_progress(self.IN_PROGRESS, float(i) / float(pages))
+
+        return skipped
+
+    def patch_page(self, page, data, offset, length):
+        """
+        Replace a part of a page of the flash memory
+
+        `length` words (four bytes) of the page data starting at word
+        `offset` are sent, the rest of the page keeps the content of the
+        flash. Returns the flags of the acknowledge like program_page().
+        """
+        data = [ord(x) for x in data[offset * 4:(offset + length) * 4]]
+        size = 8 if self.board.extended_data else 4
+        chunks = [data[i:i + size] for i in range(0, len(data), size)]
+
+        self._send(subject=MessageSubject.PATCH_PAGE,
+                   data=[page >> 8, page & 0xff, offset, length])
+
+        counter = Message.START_OF_MESSAGE_MASK | (len(chunks) - 1)
+        for chunk in chunks[:-1]:
+            self._send(subject=MessageSubject.DATA, data=chunk,
+                       counter=counter, response=False)
+            counter = (counter & ~Message.START_OF_MESSAGE_MASK) - 1
+        answer = self._send(subject=MessageSubject.DATA, data=chunks[-1], counter=counter)
+
+        if answer.data[0] << 8 | answer.data[1] != page:
+            raise BootloaderException("Could not patch page %i!" % page)
+        return answer.data[2]
+
+    def _find_patches(self, page_map, base):
+        """
+        Pages which differ only in a small part from the image `base`
+
+        Returns a dictionary page -> (offset, length) of the changed part
+        in words (four bytes), the length is zero for unchanged pages. Only
+        pages where the device still holds the content of `base` (same
+        CRC) are included.
+        """
+        base_map = self._split_pages(base)
+        words = self.board.pagesize // 4
+
+        patches = {}
+        for page, data in page_map.items():
+            old = base_map.get(page)
+            if old is None:
+                continue
+
+            changed = [i for i in range(words) if data[i * 4:i * 4 + 4] != old[i * 4:i * 4 + 4]]
+            if changed:
+                offset = changed[0]
+                length = changed[-1] - offset + 1
+                if length > words // 2:
+                    continue
+            else:
+                offset = length = 0
+
+            try:
+                if self.flash_crc(page) != crc.crc_ccitt(ord(x) for x in old):
+                    continue
+            except BootloaderException:
+                # no FLASH_CRC, the content of the device is unknown
+                return {}
+            patches[page] = (offset, length)
+        return patches
+
+    def _set_ack_interval(self, interval, resync = False):
+        """
+        Acknowledge DATA transfers only every `interval` pages
+
+        Returns the next page the bootloader writes, all pages before are
+        stored. With `resync` the message number of the bootloader is
+        adopted, see _send().
+        """
+        answer = self._send(subject=MessageSubject.SET_ACK_INTERVAL, data=[interval],
+                            resync=resync)
+        return answer.data[0] << 8 | answer.data[1]
+
+    def _wait_data_ack(self, timeout):
+        """Wait for the acknowledge of the pages in flight"""
+        while True:
+            try:
+                response = self.msg_queue.get(block=True, timeout=timeout)
+            except queue.Empty:
+                raise BootloaderException("No acknowledge for the pages in flight")
+
+            if response.subject != MessageSubject.DATA:
+                continue
+            if response.type == MessageType.SUCCESS and len(response.data) >= 4:
+                return response
+            if response.type == MessageType.WRONG_NUMBER:
+                # continue with the number expected by the bootloader
+                self.msg_number = response.number
+            raise BootloaderException("Failure %i while programming" % response.type)
+
+    def _program_window(self, first, run, window, progress):
+        """
+        Program a run of consecutive pages with several pages in flight
+
+        Up to `window` pages are sent without waiting, the bootloader
+        acknowledges every `window // 2` pages with the last written page.
+        The last pages of the run are acknowledged together. After an error
+        the transfer continues with the first page the bootloader hasn't
+        stored.
+
+        Returns the number of pages which were unchanged.
+        """
+        interval = max(1, window // 2)
+        count = len(run)
+        size = 8 if self.board.extended_data else 4
+        chunks = [self._page_chunks([ord(x) for x in data], size, False)[1] for data in run]
+
+        skipped = 0
+        failures = 0
+
+        self._send(subject=MessageSubject.SET_ADDRESS, data=[first >> 8, first & 0xff, 0, 0])
+        acked = sent = 0
+        group_end = 0
+        ack_interval = None
+
+        while acked < count:
+            # The interval of the bootloader can only be changed when all
+            # pages are acknowledged
+            if sent == group_end and sent < count:
+                group = min(interval, count - sent)
+                if group == ack_interval:
+                    group_end += group
+                elif sent == acked:
+                    self._set_ack_interval(group)
+                    ack_interval = group
+                    group_end += group
+
+            if sent < group_end and sent - acked < window:
+                messages = chunks[sent]
+                for k, data in enumerate(messages):
+                    counter = len(messages) - 1 - k
+                    if k == 0:
+                        counter |= Message.START_OF_MESSAGE_MASK
+                    self._send(subject=MessageSubject.DATA, data=data,
+                               counter=counter, response=False)
+                sent += 1
+                continue
+
+            try:
+                answer = self._wait_data_ack(timeout = 0.5 + 0.1 * window)
+            except BootloaderException as msg:
+                failures += 1
+                if failures > 5:
+                    raise
+                print("Exception: %s" % msg)
+
+                # wait for the responses to the remaining messages. The
+                # message number is out of step if the last DATA message or
+                # its error response was lost.
+                time.sleep(0.3)
+                page = self._set_ack_interval(1, resync=True)
+                if not first <= page <= first + count:
+                    raise BootloaderException("Bootloader continues with page %i!" % page)
+
+                if page < first + count:
+                    self._send(subject=MessageSubject.SET_ADDRESS, data=[page >> 8, page & 0xff, 0, 0])
+                acked = sent = group_end = page - first
+                ack_interval = 1
+                progress(acked)
+                continue
+
+            failures = 0
+            page = answer.data[0] << 8 | answer.data[1]
+            if not first + acked <= page < first + sent:
+                raise BootloaderException("Could not write page %i!" % (first + acked))
+            acked = page - first + 1
+            skipped += answer.data[3]
+            progress(acked)
+
+        # single pages (program_page()) expect an acknowledge for every page
+        if ack_interval != 1:
+            self._set_ack_interval(1)
+
+        return skipped
+
+    def _application_pages(self, segments, ignore_bootloader = False):
+        """
+        Page map of the segments limited to the application section
+
+        Data behind the application section is rejected. Images may contain
+        the bootloader as well, with `ignore_bootloader` data in the boot
+        section is ignored as it can't be overwritten. The boot section is
+        at most half of the flash, the flash ends at the next power of two.
+        """
+        page_map = self._split_pages(segments)
+
+        outside = [page for page in page_map if page >= self.board.pages]
+        if outside:
+            flash_pages = 1
+            while flash_pages < self.board.pages:
+                flash_pages *= 2
+            if not ignore_bootloader or max(outside) >= flash_pages:
+                raise BootloaderException("Programsize exceeds available Flash!")
+            print("ignore %i page(s) in the boot section" % len(outside))
+            for page in outside:
+                del page_map[page]
+        return page_map
+
+    def _page_runs(self, page_map):
+        """Returns (first page, number of pages) for every run of consecutive pages"""
+        runs = []
+        for page in page_map:
+            if runs and runs[-1][0] + runs[-1][1] == page:
+                runs[-1][1] += 1
+            else:
+                runs.append([page, 1])
+        return [tuple(run) for run in runs]
+
+    def erase_range(self, page, count):
+        """
+        Erase a range of pages
+
+        The bootloader erases the pages in the background and reports the
+        number of remaining pages regularly.
+
+        Returns False if the bootloader doesn't support ERASE_RANGE, which
+        is decided by the error response to the first request. The caller
+        has to erase the complete flash instead.
+        """
+        if self.board.erase_range is False:
+            return False
+
+        try:
+            answer = self._send(subject=MessageSubject.ERASE_RANGE,
+                                data=[page >> 8, page & 0xff, count >> 8, count & 0xff])
+        except ErrorResponse:
+            if self.board.erase_range:
+                raise
+            self.debug("ERASE_RANGE not available")
+            self.board.erase_range = False
+            return False
+        self.board.erase_range = True
+
+        remaining = answer.data[0] << 8 | answer.data[1]
+        while remaining > 0:
+            try:
+                response = self.msg_queue.get(block=True, timeout=0.5)
+            except queue.Empty:
+                # A lost report is no problem, the next command is only
+                # answered after the erase has finished.
+                timeout = 0.5 + remaining * 0.005
+                self._send(subject=MessageSubject.IDENTIFY, timeout=timeout)
+                return True
+
+            if response.subject == MessageSubject.ERASE_RANGE and \
+                    response.type == MessageType.SUCCESS:
+                remaining = response.data[0] << 8 | response.data[1]
+                self.debug("erase: %i page(s) remaining" % remaining)
+
+        return True
+
+    # counters of the STATS command in the order of the response
+    STATS_COUNTERS = ["frames_received", "frames_rejected", "rx_overruns",
+                      "sequence_errors", "pages_written", "pages_skipped"]
+
+    def stats(self):
+        """
+        Read the counters of the bootloader
+
+        Returns a dictionary with the counters in STATS_COUNTERS and the
+        time the SPM unit was busy in seconds (spm_time). Raises a
+        BootloaderException if the bootloader doesn't count.
+        """
+        answers = self._send(subject=MessageSubject.STATS, frames=4)
+
+        # sort the frames by their data counter, see read_flash()
+        block = [None] * 4
+        for answer in answers:
+            index = 3 - (answer.data_counter & ~Message.START_OF_MESSAGE_MASK)
+            if 0 <= index < 4:
+                block[index] = answer.data
+        if None in block:
+            raise BootloaderException("Incomplete statistics!")
+
+        data = [x for b in block for x in b]
+        values = [data[i] << 8 | data[i + 1] for i in range(0, len(data), 2)]
+
+        stats = dict(zip(self.STATS_COUNTERS, values))
+        stats["spm_time"] = (values[6] << 16 | values[7]) * 0.0001
+        return stats
+
+    # events recorded by bootloaders with BOOT_TRACE
+    TRACE_EVENTS = {1: "rx", 2: "tx", 3: "erase", 4: "write", 5: "spm done", 6: "state"}
+    TRACE_STATES = {0: "idle", 1: "collect_data", 2: "collect_eeprom_data", 3: "received_page"}
+
+    def read_trace(self):
+        """
+        Read the event trace of the bootloader
+
+        Returns a list of (time in seconds, event, argument), the time is
+        relative to the first event. The bootloader clears the trace
+        afterwards.
+        """
+        answer = self._send(subject=MessageSubject.TRACE_DUMP)
+        count = answer.data[0]
+        if count == 0:
+            return []
+
+        answers = self._send(subject=MessageSubject.TRACE_DUMP, data=[1], frames=count)
+        if count == 1:
+            answers = [answers]
+
+        # sort the frames by their data counter, see read_flash()
+        block = [None] * count
+        for answer in answers:
+            index = count - 1 - (answer.data_counter & ~Message.START_OF_MESSAGE_MASK)
+            if 0 <= index < count:
+                block[index] = answer.data
+        if None in block:
+            raise BootloaderException("Incomplete trace!")
+
+        # the timestamps of the CAN timer (100 us) wrap around after 6.5 s.
+        # Received messages carry the time stamp of their reception, which
+        # can be older than the preceding event, the difference is signed.
+        events = []
+        time = 0
+        last = None
+        for data in block:
+            stamp = data[0] << 8 | data[1]
+            if last is not None:
+                delta = (stamp - last) & 0xffff
+                if delta >= 0x8000:
+                    delta -= 0x10000
+                time += delta
+            last = stamp
+            events.append((time * 0.0001, data[2] >> 4, (data[2] & 0x0f) << 8 | data[3]))
+        return events
+
+    def print_trace(self):
+        """Print the event trace as a timeline"""
+        events = self.read_trace()
+        print("Trace (%i events):" % len(events))
+
+        previous = 0.0
+        for time, event, arg in events:
+            name = self.TRACE_EVENTS.get(event, "event %i" % event)
+            if event in (1, 2):
+                # command and type of the message
+                try:
+                    detail = "%s.%s" % (MessageSubject(arg & 0x3f).__str__().upper(),
+                                        MessageType(arg >> 6))
+                except KeyError:
+                    detail = "0x%02x" % arg
+            elif event in (3, 4):
+                detail = "page %i" % arg
+            elif event == 6:
+                detail = self.TRACE_STATES.get(arg, "%i" % arg)
+            else:
+                detail = ""
+            print("  %9.4f  +%7.2f ms  %-8s %s" % (time, (time - previous) * 1000, name, detail))
+            previous = time
+
+    def chip_erase(self):
+        """Erase the application section of the flash"""
+        # the bootloader needs a few milliseconds per page
+        timeout = 0.5 + self.board.pages * 0.005
+        self._send(subject=MessageSubject.CHIP_ERASE, timeout=timeout)
+
+    def write_descriptor(self, segments):
+        """
+        Write the application descriptor
+
+        The descriptor contains the length and the CRC of the application.
+        Bootloaders with fast start support use it to start a valid
+        application directly after a reset.
+        """
+        pagesize = self.board.pagesize
+        image = self._application_image(segments)
+
+        last = self.board.pages - 1
+        if len(image) > last * pagesize + pagesize - self.DESCRIPTOR_SIZE:
+            raise BootloaderException("No space left for the application descriptor!")
+
+        descriptor = self._descriptor(image)
+
+        # keep the part of the application in the last page
+        data = image[last * pagesize:]
+        data += [0xff] * (pagesize - self.DESCRIPTOR_SIZE - len(data)) + descriptor
+
+        self.program_page(page = last, data = "".join(chr(x) for x in data))
+
+    def _application_image(self, segments):
+        """
+        Returns the bytes of the application from address zero
+
+        The gaps between the segments are blank (see program()), data
+        behind the application section is ignored.
+        """
+        pagesize = self.board.pagesize
+        page_map = self._split_pages(segments)
+
+        end = self.board.pages * pagesize
+        length = max(min(segment.address + len(segment), end)
+                     for segment in segments if segment.address < end)
+        image = []
+        for page in range((length + pagesize - 1) // pagesize):
+            image += self._pad_page(page_map.get(page, ""))
+        return image[:length]
+
+    def _descriptor(self, image):
+        """Returns the bytes of the application descriptor of an image"""
+        value = crc.crc_ccitt(image)
+        length = len(image)
+        return [self.DESCRIPTOR_MAGIC & 0xff, self.DESCRIPTOR_MAGIC >> 8,
+                length & 0xff, (length >> 8) & 0xff,
+                (length >> 16) & 0xff, (length >> 24) & 0xff,
+                value & 0xff, value >> 8]
+
+    def program_staged(self, segments, window = 1, ignore_bootloader = False):
+        """
+        Program the AVR through the staging area (requires BOOT_STAGING)
+
+        The image and its descriptor are written into the upper half of
+        the application section, the application stays untouched and
+        bootable until the transfer is complete. Afterwards the bootloader
+        checks the CRC of the staged image and copies it over the
+        application in one local pass.
+
+        The device still waits in the bootloader during the transfer.
+        Applications which fill the staging area themselves stay available
+        until the copy, see app/bootloader_entry.h of the bootloader.
+
+        `ignore_bootloader` see program().
+        """
+        self._report_progress(self.WAITING)
+
+        print("connecting ... ", end="")
+        sys.stdout.flush()
+
+        self.identify()
+
+        print("ok")
+        print(self.board)
+
+        if self.board.bootloader_type == 0:
+            raise BootloaderException("Staging requires an extended Bootloader. Aborting!")
+
+        pagesize = self.board.pagesize
+        staging_page = self.board.pages // 2
+        staging_pages = self.board.pages - 1 - staging_page
+
+        self._application_pages(segments, ignore_bootloader)
+        image = self._application_image(segments)
+        if len(image) > staging_pages * pagesize - self.DESCRIPTOR_SIZE:
+            raise BootloaderException("The image doesn't fit into the staging area (%i pages)!" % staging_pages)
+
+        stage_map = {}
+        for offset in range(0, len(image), pagesize):
+            data = image[offset:offset + pagesize]
+            data += [0xff] * (pagesize - len(data))
+            stage_map[staging_page + offset // pagesize] = "".join(chr(x) for x in data)
+
+        # the descriptor occupies the last eight bytes of the staging area
+        last = staging_page + staging_pages - 1
+        data = [ord(x) for x in stage_map.get(last, "\xff" * pagesize)]
+        data = data[:pagesize - self.DESCRIPTOR_SIZE] + self._descriptor(image)
+        stage_map[last] = "".join(chr(x) for x in data)
+
+        window = self._check_window(window)
+
+        print("stage %i pages at page %i\n" % (len(stage_map), staging_page))
+        print("Program:")
+
+        self._report_progress(self.START)
+        starttime = time.time()
+        self._write_pages(stage_map, window, len(stage_map))
+        self._report_progress(self.END)
+        print("%.2f seconds\n" % (time.time() - starttime))
+
+        print("copy ... ", end="")
+        sys.stdout.flush()
+
+        starttime = time.time()
+        self.commit_staged()
+        print("ok (%.2f seconds)\n" % (time.time() - starttime))
+
+    def commit_staged(self):
+        """
+        Copy the image in the staging area over the application
+
+        The bootloader checks the CRC of the staged image, copies it in
+        the background and reports the number of remaining pages
+        regularly like ERASE_RANGE.
+        """
+        answer = self._send(subject=MessageSubject.COMMIT_STAGED, attempts=1)
+
+        remaining = answer.data[0] << 8 | answer.data[1]
+        while remaining > 0:
+            try:
+                response = self.msg_queue.get(block=True, timeout=0.5)
+            except queue.Empty:
+                # A lost report is no problem, the next command is only
+                # answered after the copy has finished.
+                timeout = 0.5 + remaining * 0.02
+                self._send(subject=MessageSubject.IDENTIFY, timeout=timeout)
+                return
+
+            if response.subject == MessageSubject.COMMIT_STAGED and \
+                    response.type == MessageType.SUCCESS:
+                remaining = response.data[0] << 8 | response.data[1]
+                self.debug("copy: %i page(s) remaining" % remaining)
+
+    def set_boot_window(self, milliseconds):
+        """
+        Set the time the bootloader waits for the host after a reset
+
+        Zero restores the default of 500 ms.
+        """
+        value = int(round(milliseconds / 10.0))
+        if not 0 <= value < 255:
+            raise BootloaderException("Boot window must be shorter than 2.55 seconds!")
+
+        self._send(subject=MessageSubject.SET_BOOT_WINDOW, data=[value])
+
+    def set_session_bitrate(self, bitrate):
+        """
+        Switch the bus to another bitrate until the bootloader is left
+
+        The bitrate (0..8) is not stored. Host and bootloader change the
+        bitrate after the response, the following IDENTIFY confirms it.
+        Without a confirmation both return to the previous bitrate.
+
+        Only useful if the board is the only other node on the bus.
+        Returns True if the new bitrate is used.
+        """
+        if bitrate not in self.SESSION_BITRATES:
+            raise BootloaderException("Bitrate %i is not supported by the bootloader!" % bitrate)
+
+        previous = getattr(self.interface, "bitrate", None)
+        if previous is None:
+            raise BootloaderException("The CAN interface can't change the bitrate!")
+        if bitrate == previous:
+            return True
+
+        self._send(subject=MessageSubject.SESSION_BITRATE,
+                   data=[self.SESSION_BITRATES[bitrate]])
+        self.interface.set_bitrate(bitrate)
+
+        try:
+            self._send(subject=MessageSubject.IDENTIFY, timeout=0.1, attempts=3)
+            return True
+        except BootloaderException:
+            pass
+
+        # wait until the bootloader has returned to the previous bitrate
+        self.interface.set_bitrate(previous)
+        time.sleep(self.SESSION_BITRATE_TIMEOUT)
+
+        self._send(subject=MessageSubject.IDENTIFY, timeout=0.1, attempts=5)
+        return False
+
+    def set_identifiers(self, request = None, response = None):
+        """
+        Store the request and response identifier of the board
+
+        The identifiers are used after the next reset. Without arguments
+        the identifiers derived from the board id are restored.
+        """
+        if request is None and response is None:
+            request = response = 0xffff
+        elif not (0 <= request < 0x7fe and 0 <= response < 0x7fe) or request == response:
+            raise BootloaderException("Invalid identifiers 0x%x, 0x%x!" % (request, response))
+
+        self._send(subject=MessageSubject.SET_IDENTIFIERS,
+                   data=[request >> 8, request & 0xff, response >> 8, response & 0xff])
+
+    def verify(self, segments, ignore_bootloader = False):
         """
         Verify the program on the AVR
 
         First the function waits for a connection then it will send the
         data page by page. Finally the written application will be started.
+
+        `ignore_bootloader` see program().
         """
         self._report_progress(self.WAITING)
 
         # try to connect to the bootloader
         self.identify()
 
-        totalsize = functools.reduce(lambda x,y: x + y, map(lambda x: len(x), segments))
-        segment_number = 0
-
-        pagesize = self.board.pagesize
-        pages = int(math.ceil(float(totalsize) / float(pagesize)))
-
         if self.board.bootloader_type == 0:
             raise BootloaderException("Verify requires an extended Bootloader. Aborting!")
 
-        if pages > self.board.pages:
-            raise BootloaderException("Programsize exceeds available Flash!")
+        page_map = self._application_pages(segments, ignore_bootloader)
+        pages = len(page_map)
+        totalsize = pages * self.board.pagesize
 
         print("Verify:")
 
         # start progressbar
         self._report_progress(self.START)
         starttime = time.time()
-        offset = 0
 
-        for i in range(pages):
-            data = segments[segment_number]
-            self.verify_page(page = i,
-                             data = data[offset:offset+pagesize])
-            offset += pagesize
-            if offset >= len(data):
-                offset = 0
-                segment_number += 1
-                self.debug("Now starting segment %i" % segment_number)
-            self._report_progress(self.IN_PROGRESS, float(i) / float(pages))
+        runs = [range(first, first + count) for first, count in self._page_runs(page_map)]
+
+        # Compare the CRC of every run of pages first. Only if it differs
+        # every page of the run is checked to find the mismatching ones.
+        failed = []
+        done = 0
+        for run in runs:
+            try:
+                total = self.flash_crc(run[0], len(run))
+            except BootloaderException:
+                # bootloader doesn't support the CRC command => compare
+                # every four bytes
+                self.debug("CRC not available, verify data")
+                for page in run:
+                    self.verify_page(page = page, data = page_map[page])
+                    done += 1
+                    self._report_progress(self.IN_PROGRESS, float(done) / float(pages))
+                continue
+
+            expected = 0xffff
+            for page in run:
+                expected = crc.crc_ccitt(self._pad_page(page_map[page]), expected)
+
+            if total != expected:
+                for page in run:
+                    if self.flash_crc(page) != self._page_crc(page_map[page]):
+                        failed.append(page)
+
+            done += len(run)
+            self._report_progress(self.IN_PROGRESS, float(done) / float(pages))
+
+        if failed:
+            raise BootloaderException("Verify failed for page(s) %s!" %
+                                      ", ".join(str(i) for i in failed))
 
         # show a 100% progressbar
         self._report_progress(self.END)
@@ -534,13 +1778,57 @@ class Bootloader:
                           data = [] )
         self.interface.send(message.encode())
 
+    def enter_bootloader(self, timeout = 0.25):
+        """
+        Request the bootloader from a running application
+
+        Applications using bootloader_entry.h reset into the bootloader,
+        which announces itself with an IDENTIFY response and waits for the
+        host without a timeout.
+
+        Returns True if the bootloader was announced, otherwise the board
+        has to be reached with identify().
+        """
+        # clear the message queue
+        while True:
+            try:
+                self.msg_queue.get(False, 0)
+            except queue.Empty:
+                break
+
+        self.start_bootloader()
+
+        end = time.time() + timeout
+        while True:
+            remaining = end - time.time()
+            if remaining <= 0:
+                return False
+
+            try:
+                response = self.msg_queue.get(block=True, timeout=remaining)
+            except queue.Empty:
+                return False
+
+            if response.subject == MessageSubject.IDENTIFY and \
+                    response.type == MessageType.SUCCESS:
+                self._decode_response_identify(response, self.board)
+                self.board.connected = True
+
+                # the announcement is not an answer to a numbered request
+                self.msg_number = 0
+                return True
+
     def _send(self,
               subject,
               data = [],
               counter = Message.START_OF_MESSAGE_MASK | 0,
               response = True,
               timeout = 0.5,
-              attempts = 2):
+              attempts = 2,
+              frames = 1,
+              numbered = True,
+              number = None,
+              resync = False):
 
         """
         Send a message via CAN Bus
@@ -551,19 +1839,30 @@ class Bootloader:
 
         Keeps track of the message numbering and restores the correct number
         in case of a reported error.
+
+        Requests which are answered with a block of messages return the
+        list of all `frames` responses in the order of their arrival.
+
+        Messages which are not numbered by the bootloader (DATA_OFFSET)
+        don't advance the message number, `number` replaces it for these.
+
+        With `resync` the number expected by the bootloader is adopted at
+        any time, e.g. after messages without response were lost.
         """
 
         message = Message(board_id = self.board.id,
                           messageType = MessageType.REQUEST,
                           subject = subject,
-                          number = self.msg_number,
+                          number = self.msg_number if number is None else number,
                           data_counter = counter,
-                          data = data )
+                          data = data,
+                          identifier = self.identifiers[0] if self.identifiers else None)
 
         if not response:
             # no response needed, just send the message and return
             self.interface.send( message.encode() )
-            self.msg_number = (self.msg_number + 1) & 0xff
+            if numbered:
+                self.msg_number = (self.msg_number + 1) & 0xff
             return None
 
         repeats = 0
@@ -578,6 +1877,8 @@ class Bootloader:
                 break
 
         while not finished:
+            responses = []
+
             # send the message
             self.interface.send(message.encode())
 
@@ -590,6 +1891,10 @@ class Bootloader:
                 else:
                     if response_msg.subject == message.subject:
                         if response_msg.type == MessageType.SUCCESS:
+                            responses.append(response_msg)
+                            if len(responses) < frames:
+                                continue
+
                             finished = True
 
                             # drain message queue to delete answers to repeated transmits
@@ -604,9 +1909,10 @@ class Bootloader:
                             self.debug("Warning: Wrong message number detected (board: 0x%02x, here: 0x%02x)" %
                                     (response_msg.number, message.number))
 
-                            # reset message number only if we just started the communication
+                            # reset message number only if we just started the
+                            # communication or a resync was requested
                             resetted = False
-                            if message.number == 0:
+                            if message.number == 0 or resync:
                                 self.debug("Reset to 0x%02x" % response_msg.number)
                                 self.msg_number = response_msg.number
                                 message.number = response_msg.number
@@ -625,8 +1931,8 @@ class Bootloader:
                             if not resetted:
                                 break
                         else:
-                            raise BootloaderException("Failure %i while sending '%s'" %
-                                                        (response_msg.type, message))
+                            raise ErrorResponse("Failure %i while sending '%s'" %
+                                                    (response_msg.type, message), response_msg)
                     else:
                         self.debug("Warning: Discarding obviously old message (received %i/%x, here: %i/%x)" %
                                     (response_msg.subject, response_msg.number, message.subject, message.number))
@@ -637,7 +1943,10 @@ class Bootloader:
                                             (repeats, timeout, message))
 
         # increment the message number
-        self.msg_number = (self.msg_number + 1) & 0xff
+        if numbered:
+            self.msg_number = (self.msg_number + 1) & 0xff
+        if frames > 1:
+            return responses
         return response_msg
 
     def _get_message(self, can_message):
@@ -666,10 +1975,103 @@ class Bootloader:
         pass
 
 
+class BootloaderGroup:
+    """
+    Program several boards with the same application
+
+    The program is sent only once to the multicast board id. Every board
+    of the group records the pages it has written, missing pages are sent
+    to the individual boards afterwards.
+    """
+
+    def __init__(self, clients, group_id = 1, page_delay = 0.02):
+        """
+        clients     -- list of Bootloader objects, one for every board
+        group_id    -- 1..255, must be unique on the bus
+        page_delay  -- pause after every page to give the boards time to
+                       write it, group messages are not acknowledged
+        """
+        if not 0 < group_id < 256:
+            raise BootloaderException("Invalid group id %i" % group_id)
+
+        self.clients = clients
+        self.group_id = group_id
+        self.page_delay = page_delay
+        self.interface = clients[0].interface
+
+    def program(self, segments, ignore_bootloader = False):
+        for client in self.clients:
+            print("connecting ... ", end="")
+            sys.stdout.flush()
+            client.identify()
+            print("ok")
+            print(client.board)
+
+            if not client.board.multicast:
+                raise BootloaderException("Board %i doesn't support multicast programming!" % client.board.id)
+
+        first = self.clients[0]
+        if any(client.board.pagesize != first.board.pagesize for client in self.clients):
+            raise BootloaderException("All boards of a group need the same pagesize!")
+
+        page_data = first._application_pages(segments, ignore_bootloader)
+        if any(client.board.fast_start for client in self.clients):
+            page_data = first._fill_gaps(page_data)
+        if any(page >= client.board.pages for page in page_data for client in self.clients):
+            raise BootloaderException("Programsize exceeds available Flash!")
+
+        for client in self.clients:
+            client.join_group(self.group_id)
+
+        compressed = all(client.board.compressed_data for client in self.clients)
+
+        print("write %i pages to %i boards\n" % (len(page_data), len(self.clients)))
+        starttime = time.time()
+
+        for page, data in page_data.items():
+            data = first._pad_page(data)
+            subject, chunks = first._page_chunks(data, 4, compressed)
+
+            # every page is sent as a single block
+            self._send(MessageSubject.SET_ADDRESS, [page >> 8, page & 0xff, 0, 0])
+            for i, chunk in enumerate(chunks):
+                counter = len(chunks) - 1 - i
+                if i == 0:
+                    counter |= Message.START_OF_MESSAGE_MASK
+                self._send(subject, chunk, counter)
+
+            time.sleep(self.page_delay)
+
+        # send the pages lost by individual boards
+        for client in self.clients:
+            missing = [page for page in client.missing_pages(max(page_data) + 1)
+                       if page in page_data]
+            if missing:
+                print("board %i: repair %i page(s)" % (client.board.id, len(missing)))
+            for page in missing:
+                client.program_page(page, page_data[page])
+
+            if client.board.fast_start:
+                client.write_descriptor(segments)
+
+        totaltime = time.time() - starttime
+        print("%.2f seconds\n" % totaltime)
+
+    def _send(self, subject, data, counter = Message.START_OF_MESSAGE_MASK | 0):
+        """Group messages carry the group id instead of the message number"""
+        message = Message(board_id = 0,
+                          messageType = MessageType.REQUEST,
+                          subject = subject,
+                          number = self.group_id,
+                          data_counter = counter,
+                          data = data)
+        self.interface.send(message.encode())
+
+
 class CommandlineClient(Bootloader):
 
-    def __init__(self, board_id, interface, debug):
-        Bootloader.__init__(self, board_id, interface, debug)
+    def __init__(self, board_id, interface, debug, identifiers = None):
+        Bootloader.__init__(self, board_id, interface, debug, identifiers)
 
         # create a progressbar to show the progress while programming
         self.progressbar = progressbar.ProgressBar(max = 1.0, width = 60)
@@ -133,6 +133,10 @@ class SerialInterface:
         self.isConnected = False
 
 
+    def set_bitrate(self, bitrate):
+        """Change the bitrate of the CAN bus"""
+        raise CanException("changing the bitrate is not supported by this interface")
+
     def _debug(self, text):
         if self.debugFlag:
             print(text)
@@ -173,15 +177,25 @@ class Usb2Can(SerialInterface, dispatcher.MessageDispatcher):
         SerialInterface.__init__(self, port, baud, debug)
         dispatcher.MessageDispatcher.__init__(self)
 
-    def connect(self, port = None, baud = None, bitrate=4, debug = None):
+        self.bitrate = bitrate
+
+    def connect(self, port = None, baud = None, bitrate=None, debug = None):
         SerialInterface.connect(self, port, baud, debug)
 
-        self.bitrate = bitrate if bitrate else self.bitrate
+        self.bitrate = bitrate if bitrate is not None else self.bitrate
 
         # set bitrate and open the channel
         self._sendRaw("S%i\r" % self.bitrate)
         self._sendRaw("O\r")
 
+    def set_bitrate(self, bitrate):
+        """Close the channel and open it again with another bitrate (0..8)"""
+        self.bitrate = bitrate
+
+        self._sendRaw("C\r")
+        self._sendRaw("S%i\r" % self.bitrate)
+        self._sendRaw("O\r")
+
     def _decode(self, byte):
         if byte != '\r':
             self._buf.append(byte)
@@ -7,5 +7,7 @@
 # License, v. 2.0. If a copy of the MPL was not distributed with this
 # file, You can obtain one at http://mozilla.org/MPL/2.0/.
 
+from . import crc
 from . import intelhex
+from . import lz
 from . import progressbar
@@ -0,0 +1,27 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2010, 2015-2017 Fabian Greif.
+# All rights reserved.
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+
+def crc_ccitt_update(crc, data):
+    """ Same calculation as _crc_ccitt_update() from avr-libc """
+    data ^= crc & 0xff
+    data ^= (data << 4) & 0xff
+    return (((data << 8) | (crc >> 8)) ^ (data >> 4) ^ (data << 3)) & 0xffff
+
+
+def crc_ccitt(data, crc = 0xffff):
+    """ Calculates the CRC of a sequence of bytes """
+    for byte in data:
+        crc = crc_ccitt_update(crc, byte)
+    return crc
+
+
+if __name__ == '__main__':
+    # Check value of the CRC-16/MCRF4XX
+    print("%04x" % crc_ccitt(b"123456789"))
@@ -58,6 +58,7 @@ class IntelHexParser:
         segmentdata = []
         currentAddr = 0
         startAddr   = 0
+        baseAddr    = 0
 
         for line in file:
             l = line.strip("\n\r")
@@ -86,6 +87,8 @@ class IntelHexParser:
                 raise HexParserException("Checksum Error.")
 
             if linetype == 0x00:
+                # Basisadresse aus den Records vom Typ 02 und 04 addieren
+                address += baseAddr
                 if currentAddr != address:
                     if segmentdata:
                         self.segments.append( Segment(startAddr, ''.join(segmentdata)) )
@@ -100,7 +103,14 @@ class IntelHexParser:
                     break
                 else:
                     raise HexParserException("Invalid End-of-File Record")
-            elif linetype in (0x02, 0x03, 0x04):
+            elif linetype == 0x02:
+                # Extended Segment Address Record (Adresse * 16)
+                baseAddr = int(l[9:13], 16) << 4
+            elif linetype == 0x04:
+                # Extended Linear Address Record (obere 16 Bit)
+                baseAddr = int(l[9:13], 16) << 16
+            elif linetype in (0x03, 0x05):
+                # Startadressen werden nicht benoetigt
                 pass
             else:
                 sys.stderr.write("Ignored unknown field (type 0x%02x) in ihex file.\n" % linetype)
@@ -128,6 +138,27 @@ class IntelHexParser:
 
         return ''.join(buffer)
 
+def write_hex_file(filename, address, data):
+    """ Schreibt eine Liste von Bytes im Intel-Hex Format
+
+    Adressen oberhalb von 64 kB werden mit Extended Linear Address
+    Records (Typ 04) erzeugt.
+    """
+    def record(address, linetype, data):
+        bb = [len(data), (address >> 8) & 0xff, address & 0xff, linetype] + list(data)
+        crc = (-sum(bb)) & 0xff
+        return ":" + "".join("%02X" % b for b in bb) + "%02X\n" % crc
+
+    with open(filename, "w") as file:
+        upper = None
+        for offset in range(0, len(data), 16):
+            current = address + offset
+            if (current >> 16) != upper:
+                upper = current >> 16
+                file.write(record(0, 0x04, [upper >> 8, upper & 0xff]))
+            file.write(record(current & 0xffff, 0x00, data[offset:offset + 16]))
+        file.write(record(0, 0x01, []))
+
 # kleines Beispiel zur Verwendung des Intelhexparsers
 #
 # Liest eine uebergebene Intelhex-Datei ein und gibt den Inhalt entsprechend
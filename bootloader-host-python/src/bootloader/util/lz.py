@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2010, 2015-2017 Fabian Greif.
+# All rights reserved.
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+"""
+Codec for the COMPRESSED_DATA command
+
+A compressed page is a sequence of tokens:
+
+0x00..0x7f  literal run, the following (token + 1) bytes are copied
+0x80..0xff  match, (token & 0x7f) + 2 bytes are copied from the already
+            decoded data. The following byte contains the distance - 1.
+"""
+
+MAX_LITERALS = 128
+MIN_MATCH = 3
+MAX_MATCH = 129
+WINDOW = 256
+
+
+def compress(data):
+    """ Compress a list of bytes (greedy matching) """
+    out = []
+    literals = []
+    positions = {}
+
+    def flush():
+        while literals:
+            chunk = literals[:MAX_LITERALS]
+            del literals[:MAX_LITERALS]
+            out.append(len(chunk) - 1)
+            out.extend(chunk)
+
+    def index(position):
+        key = tuple(data[position:position + MIN_MATCH])
+        positions.setdefault(key, []).append(position)
+
+    i = 0
+    while i < len(data):
+        best_length = 0
+        best_distance = 0
+
+        candidates = positions.get(tuple(data[i:i + MIN_MATCH]), [])
+        for start in reversed(candidates):
+            distance = i - start
+            if distance > WINDOW:
+                break
+
+            # the match may overlap with the data to encode
+            length = 0
+            while (i + length < len(data) and length < MAX_MATCH
+                   and data[start + length] == data[i + length]):
+                length += 1
+
+            if length > best_length:
+                best_length = length
+                best_distance = distance
+                if length == MAX_MATCH:
+                    break
+
+        if best_length >= MIN_MATCH:
+            flush()
+            out.append(0x80 | (best_length - 2))
+            out.append(best_distance - 1)
+            step = best_length
+        else:
+            literals.append(data[i])
+            step = 1
+
+        for k in range(step):
+            index(i + k)
+        i += step
+
+    flush()
+    return out
+
+
+def decompress(stream):
+    """ Same decoding as lz_decode() in the bootloader """
+    out = []
+    i = 0
+    while i < len(stream):
+        token = stream[i]
+        if token & 0x80:
+            distance = stream[i + 1] + 1
+            for k in range((token & 0x7f) + 2):
+                out.append(out[-distance])
+            i += 2
+        else:
+            out.extend(stream[i + 1:i + token + 2])
+            i += token + 2
+    return out
+
+
+if __name__ == '__main__':
+    import random
+
+    page = [0x0c, 0x94, 0x34, 0x00] * 16 + [0xff] * 128 + \
+           [random.randint(0, 255) for i in range(64)]
+    stream = compress(page)
+    assert decompress(stream) == page
+    print("%i -> %i bytes" % (len(page), len(stream)))